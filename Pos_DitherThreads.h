@@ -0,0 +1,105 @@
+/*------------------------------------------------------------------------
+  Multi-threaded Floyd-Steinberg dithering for large images, for hosts
+  and multi-core boards (e.g. ESP32) with std::thread.
+
+  Error diffusion is serial from row to row, but a row only needs the
+  row above to be two pixels ahead of it.  Rows are dealt out to threads
+  in turn and each thread runs that far behind the one above: a
+  staggered wavefront.  The arithmetic is that of Pos_Dither::row(), so
+  the output is bit for bit the same as the serial kernel's, in the
+  packed 1-bit rows printBitmap() takes.
+
+  Only built where the compiler provides <thread> and <atomic>.
+  MIT license, all text above must be included in any redistribution.
+  ------------------------------------------------------------------------*/
+
+#ifndef Pos_DitherThreads_H
+#define Pos_DitherThreads_H
+
+#include "Pos_Printer.h"
+
+#if __cplusplus >= 201103L && defined(__has_include)
+#if __has_include(<thread>) && __has_include(<atomic>) && !defined(__AVR__)
+#define POS_DITHER_THREADS
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class Pos_DitherThreads {
+ public:
+  // Dithers the w x h 8-bit image gray (0 = black, 255 = white, rows w
+  // bytes apart) into bitmap, (w + 7) / 8 bytes per row, ready for
+  // printBitmap(w, h, bitmap, false).  threads = 0 uses one per core.
+  static void dither(uint8_t *bitmap, const uint8_t *gray, int w, int h,
+                     unsigned threads=0) {
+    if(!threads) threads = std::thread::hardware_concurrency();
+    if(!threads) threads = 1;
+    if(threads > (unsigned)h) threads = h;
+    if(!threads) return;
+
+    // Each thread carries its row's error to the next row in its own
+    // buffer, and publishes how far it has got as one number that only
+    // grows: row * (w + 2) + pixels done, w + 1 once the row is complete.
+    std::vector<int16_t>          err(threads * (w + 1));
+    std::vector<std::atomic<long> > progress(threads);
+    std::vector<int16_t>          zero(w + 1, 0); // Above the first row
+    std::vector<std::thread>      pool;
+
+    for(unsigned t=0; t<threads; t++) progress[t].store(-1);
+    for(unsigned t=1; t<threads; t++) {
+      pool.push_back(std::thread(run, bitmap, gray, w, h, threads, t,
+                                 err.data(), progress.data(), zero.data()));
+    }
+    run(bitmap, gray, w, h, threads, 0, err.data(), progress.data(), zero.data());
+    for(size_t i=0; i<pool.size(); i++) pool[i].join();
+  }
+
+ private:
+  static void run(uint8_t *bitmap, const uint8_t *gray, int w, int h,
+                  unsigned threads, unsigned t, int16_t *errs,
+                  std::atomic<long> *progress, const int16_t *zero) {
+    int               rowBytes = (w + 7) / 8;
+    unsigned          above    = (t + threads - 1) % threads;
+    int16_t          *out      = errs + t * (w + 1);
+    const int16_t    *in       = errs + above * (w + 1);
+    std::atomic<long> &mine    = progress[t], &wait = progress[above];
+
+    for(int y=t; y<h; y += threads) {
+      const uint8_t *line  = gray + (long)y * w;
+      uint8_t       *row   = bitmap + (long)y * rowBytes;
+      const int16_t *from  = y ? in : zero;
+      long           base  = (long)(y - 1) * (w + 2), seen = -1;
+      int16_t        v, e, right = 0, down = 0, downRight = 0;
+
+      memset(row, 0, rowBytes);
+      for(int x=0; x<w; x++) {
+        // Column x of the row above is final once it has done x + 2
+        // pixels (or all of them)
+        while(y && seen < base + x + 2) {
+          if((seen = wait.load(std::memory_order_acquire)) < base + x + 2)
+            std::this_thread::yield();
+        }
+        v = line[x] + from[x + 1] + right;
+        if(v < 128) {
+          row[x >> 3] |= 0x80 >> (x & 7); // Black
+          e = v;
+        } else {
+          e = v - 255;
+        }
+        right     = e * 7 / 16;
+        out[x]    = down + e * 3 / 16;
+        down      = downRight + e * 5 / 16;
+        downRight = e / 16;
+        mine.store((long)y * (w + 2) + x + 1, std::memory_order_release);
+      }
+      out[w] = down;
+      mine.store((long)y * (w + 2) + w + 1, std::memory_order_release);
+    }
+  }
+};
+
+#endif // __has_include(<thread>)
+#endif // C++11
+
+#endif // Pos_DitherThreads_H
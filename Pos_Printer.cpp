@@ -12,11 +12,15 @@
   ------------------------------------------------------------------------*/
 
 #include "Pos_Printer.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Though most of these printers are factory configured for 19200 baud
 // operation, a few rare specimens instead work at 9600.  If so, change
-// this constant.  This will NOT make printing slower!  The physical
-// print and feed mechanisms are the bottleneck, not the port speed.
+// this constant (or call setBaudRate()).  Text is bound by the physical
+// print and feed mechanisms, but bitmaps, QR codes and NV uploads are
+// bound by the port speed; see negotiateBaud().
 
 #define BAUDRATE  19200  //Check the switches under the PP-700II to verify baud
 
@@ -41,29 +45,177 @@
 // continue with other duties (e.g. receiving or decoding an image)
 // while the printer physically completes the task.
 
-// Number of microseconds to issue one byte to the printer.  11 bits
-// (not 8) to accommodate idle, start and stop bits.  Idle time might
-// be unnecessary, but erring on side of caution here.
-#define BYTE_TIME (((11L * 1000000L) + (BAUDRATE / 2)) / BAUDRATE)
+// Record types in a captured job (see beginCapture()):
+#define CAPTURE_DATA 0x01 // n, then n bytes for the printer (n = 1-255)
+#define CAPTURE_WAIT 0x02 // 4-byte little-endian timeoutSet() value
+#define CAPTURE_REF  0x03 // n, then the address of n bytes in RAM
+#define CAPTURE_PACE 0x04 // Unit mask, then a count per unit set (see paceUnits())
+
+// Units a wait is recorded in, so a replay paces by the replaying
+// printer's own setTimes()/setNVTimes() and baud rate (see paceTime()).
+#define PACE_MICROS   0 // Fixed delay
+#define PACE_BYTES    1 // Bytes sent
+#define PACE_PRINT    2 // Dot rows printed
+#define PACE_FEED     3 // Dot rows fed
+#define PACE_NV_WRITE 4 // NV graphics writes
+#define PACE_NV_BYTE  5 // NV graphics bytes written
+#define PACE_MACRO    6 // Runs of the stored macro
+#define PACE_UNITS    7
 
 // Constructor
 Pos_Printer::Pos_Printer(Stream *s, uint8_t dtr) :
   stream(s), dtrPin(dtr) {
-  dtrEnabled = false;
+  setBaudRate(BAUDRATE);
+  dtrEnabled     = false;
+  rasterRowBytes = 0;
+  rasterStage    = NULL;
+  rasterRows     = 0;
+  labelHeight    = 0;
+  macroRecording = false;
+  macroResident  = false;
+  captureSink    = NULL;
+  lastWrite      = 0;
+  idleCallback   = NULL;
+  jobDepth       = 0;
+  aborted        = false;
+  abortPending   = false;
+  completionOnCut    = false;
+  jobStarted         = false;
+  replyState         = 0;
+  completionCount    = 0;
+  completionId       = 0;
+  completionElapsed  = 0;
+  completionCallback = NULL;
 }
 
 // This method sets the estimated completion time for a just-issued task.
 void Pos_Printer::timeoutSet(unsigned long x) {
+  unsigned long n[PACE_UNITS] = { x };
+
+  timeoutUnits(n);
+}
+
+// Print and feed time for the given dot rows, plus the link time of
+// bytes, as one wait.
+void Pos_Printer::timeoutDots(unsigned long printRows, unsigned long feedRows,
+  unsigned long bytes) {
+  unsigned long n[PACE_UNITS] = { 0 };
+
+  n[PACE_BYTES] = bytes;
+  n[PACE_PRINT] = printRows;
+  n[PACE_FEED]  = feedRows;
+  timeoutUnits(n);
+}
+
+// Flash write time for NV graphics: a fixed cost per write plus a cost
+// per byte.
+void Pos_Printer::timeoutNV(unsigned long bytes) {
+  unsigned long n[PACE_UNITS] = { 0 };
+
+  n[PACE_NV_WRITE] = 1;
+  n[PACE_NV_BYTE]  = bytes;
+  timeoutUnits(n);
+}
+
+unsigned long Pos_Printer::paceTime(uint8_t unit) {
+  switch(unit) {
+   case PACE_BYTES:    return byteTime;
+   case PACE_PRINT:    return dotPrintTime;
+   case PACE_FEED:     return dotFeedTime;
+   case PACE_NV_WRITE: return nvWriteTime;
+   case PACE_NV_BYTE:  return nvByteTime;
+   case PACE_MACRO:    return macroTime;
+   default:            return 1;
+  }
+}
+
+// As timeoutSet(), for a wait of n[unit] of each PACE_ unit.  While
+// capturing, delays other than the plain transmit time of the last write
+// are recorded for replay, in these units rather than in this printer's
+// microseconds.  While a macro is being recorded nothing is printed, so
+// such delays are added to the macro's run time instead; the link time
+// is only paid once, when the macro is defined.
+void Pos_Printer::timeoutUnits(const unsigned long *n) {
+  unsigned long x = 0;
+  uint8_t       unit, mask = 0;
+
+  for(unit=0; unit<PACE_UNITS; unit++) {
+    if(!n[unit]) continue;
+    x    += n[unit] * paceTime(unit);
+    mask |= 1 << unit;
+  }
+  bool transmit = (x == lastWrite * byteTime);
+
+  lastWrite = 0;
+  if(captureSink) {
+    if(!transmit) {
+      captureFlush();
+      if(mask <= (1 << PACE_MICROS)) { // A plain delay
+        captureSink->write(CAPTURE_WAIT);
+        captureWrite32(x);
+      } else {
+        captureSink->write(CAPTURE_PACE);
+        captureSink->write(mask);
+        for(unit=0; unit<PACE_UNITS; unit++)
+          if(mask & (1 << unit)) captureWriteCount(n[unit]);
+      }
+    }
+    if(!captureTransmit) return;
+  }
+  if(macroRecording && !transmit) {
+    macroTime += x;
+    return;
+  }
   if(!dtrEnabled) resumeTime = micros() + x;
 }
 
 // This function waits (if necessary) for the prior task to complete.
+// Nothing to wait for when only capturing.
 void Pos_Printer::timeoutWait() {
-  if(dtrEnabled) {
-    while(digitalRead(dtrPin) == HIGH){yield();};
-  } else {
-    while((long)(micros() - resumeTime) < 0L){yield();}; // (syntax is rollover-proof)
-  }
+  while(!ready()){
+    if(idleCallback) idleCallback(idleArg);
+    yield();
+  };
+}
+
+// idle(arg) is called over and over while the library waits on the
+// printer, e.g. to prepare the next rows of an image (see Pos_RowQueue)
+// while the current ones print.  Keep each call short, and don't print
+// from it.  NULL removes it.
+void Pos_Printer::setIdleCallback(Pos_IdleCallback idle, void *arg) {
+  idleCallback = idle;
+  idleArg      = arg;
+}
+
+// True if the prior task is complete, i.e. timeoutWait() would return
+// at once.  Lets a caller drive several printers without blocking.
+bool Pos_Printer::ready() {
+  abortFlush();
+  if(captureSink && !captureTransmit) return true;
+  if(dtrEnabled) return digitalRead(dtrPin) != HIGH;
+  return (long)(micros() - resumeTime) >= 0L; // (syntax is rollover-proof)
+}
+
+// How long until ready(), for callers that sleep rather than spin.  The
+// DTR line can't be predicted, so that case returns a poll interval.
+unsigned long Pos_Printer::readyIn() {
+  if(ready())    return 0;
+  if(dtrEnabled) return 1000;
+  return resumeTime - micros();
+}
+
+// Tells the library the port speed, for pacing.  Use it after opening the
+// port at a rate saved from an earlier negotiateBaud() to skip probing.
+void Pos_Printer::setBaudRate(unsigned long baud) {
+  baudRate = baud;
+  // Number of microseconds to issue one byte to the printer.  11 bits
+  // (not 8) to accommodate idle, start and stop bits.  Idle time might
+  // be unnecessary, but erring on side of caution here.
+  byteTime = ((11L * 1000000L) + (baud / 2)) / baud;
+}
+
+unsigned long Pos_Printer::getBaudRate() {
+  return baudRate;
 }
 
 // Printer performance may vary based on the power supply voltage,
@@ -86,47 +238,99 @@ void Pos_Printer::setTimes(unsigned long p, unsigned long f) {
 // commands, printing bitmaps or barcodes, etc.  Not when printing text.
 
 void Pos_Printer::writeBytes(uint8_t a) {
-  timeoutWait();
-  stream->write(a);
-  timeoutSet(BYTE_TIME);
+  uint8_t buf[] = { a };
+  writeBuffer(buf, sizeof(buf));
 }
 
 void Pos_Printer::writeBytes(uint8_t a, uint8_t b) {
-  timeoutWait();
-  stream->write(a);
-  stream->write(b);
-  timeoutSet(2 * BYTE_TIME);
+  uint8_t buf[] = { a, b };
+  writeBuffer(buf, sizeof(buf));
 }
 
 void Pos_Printer::writeBytes(uint8_t a, uint8_t b, uint8_t c) {
-  timeoutWait();
-  stream->write(a);
-  stream->write(b);
-  stream->write(c);
-  timeoutSet(3 * BYTE_TIME);
+  uint8_t buf[] = { a, b, c };
+  writeBuffer(buf, sizeof(buf));
 }
 
 void Pos_Printer::writeBytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
-  timeoutWait();
-  stream->write(a);
-  stream->write(b);
-  stream->write(c);
-  stream->write(d);
-  timeoutSet(4 * BYTE_TIME);
+  uint8_t buf[] = { a, b, c, d };
+  writeBuffer(buf, sizeof(buf));
 }
 
 // Riva Addition _ Updated
 void Pos_Printer::writeBytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e, uint8_t f, uint8_t g, uint8_t h) {
+  uint8_t buf[] = { a, b, c, d, e, f, g, h };
+  writeBuffer(buf, sizeof(buf));
+}
+
+// Bulk counterpart of writeBytes() for image data: one wait, then the
+// whole block.
+void Pos_Printer::writeBuffer(const uint8_t *buf, uint16_t n, bool inPlace) {
   timeoutWait();
-  stream->write(a);
-  stream->write(b);
-  stream->write(c);
-  stream->write(d);
-  stream->write(e);
-  stream->write(f);
-  stream->write(g);
-  stream->write(h);
-  timeoutSet(8 * BYTE_TIME);
+  emit(buf, n, inPlace);
+  timeoutSet(n * byteTime);
+}
+
+// Every byte for the printer passes through here, so a capture (see
+// beginCapture()) sees exactly what the printer would.
+void Pos_Printer::emit(const uint8_t *buf, uint16_t n, bool inPlace) {
+  abortFlush();
+  if(aborted) return; // Rest of an aborted call
+  lastWrite = n;
+  if(captureSink) {
+    if(captureCount + n > sizeof(captureStage)) captureFlush();
+    if(inPlace && captureInPlace && n <= 255) {
+      captureFlush();
+      captureSink->write(CAPTURE_REF);
+      captureSink->write(n);
+      captureSink->write((const uint8_t *)&buf, sizeof(buf));
+    } else if(n > sizeof(captureStage)) {
+      for(uint16_t i=0; i<n; i += 255) {
+        uint8_t len = (n - i > 255) ? 255 : n - i;
+        captureSink->write(CAPTURE_DATA);
+        captureSink->write(len);
+        captureSink->write(buf + i, len);
+      }
+    } else {
+      memcpy(captureStage + captureCount, buf, n);
+      captureCount += n;
+    }
+    if(!captureTransmit) return;
+  }
+  if(!jobStarted) {
+    jobStarted   = true;
+    jobStartTime = micros();
+  }
+  stream->write(buf, n);
+  noteCompletion(buf, n);
+}
+
+// GS ( H <fn=48> as it reaches the stream, whether from
+// requestCompletion() directly or from a replayed capture.  A request is
+// never split across writes: requestCompletion() issues it as one block
+// and a capture keeps each block within one record.
+static const uint8_t completionRequest[] = { ASCII_GS, '(', 'H', 6, 0, 48, 48 };
+
+void Pos_Printer::noteCompletion(const uint8_t *buf, uint16_t n) {
+  for(uint16_t i=0; i + 11 <= n; i++) {
+    if(buf[i] != completionRequest[0] ||
+       memcmp(buf + i, completionRequest, sizeof(completionRequest))) continue;
+    const uint8_t *d = buf + i + sizeof(completionRequest);
+    if(completionCount == POS_COMPLETION_QUEUE) { // Drop the oldest
+      completionCount--;
+      memmove(completionIds, completionIds + 1,
+              completionCount * sizeof(completionIds[0]));
+      memmove(completionStarts, completionStarts + 1,
+              completionCount * sizeof(completionStarts[0]));
+    }
+    completionIds[completionCount] =
+      (d[0] - '0') * 1000 + (d[1] - '0') * 100 + (d[2] - '0') * 10 + (d[3] - '0');
+    completionStarts[completionCount++] = jobStartTime;
+    i += 10;
+    // Whatever follows is the next job
+    jobStarted   = (i + 1 < n);
+    jobStartTime = micros();
+  }
 }
 
 // The underlying method for all high-level printing (e.g. println()).
@@ -145,18 +349,22 @@ size_t Pos_Printer::write(uint8_t c) {
   #endif // end ifdef DENMARK
 	  
     timeoutWait();
-    stream->write(c);
-    unsigned long d = BYTE_TIME;
+    emit(&c, 1);
+    uint8_t printRows = 0, feedRows = 0;
     if((c == '\n') || (column == maxColumn)) { // If newline or wrap
-      d += (prevByte == '\n') ?
-        ((charHeight+lineSpacing) * dotFeedTime) :             // Feed line
-        ((charHeight*dotPrintTime)+(lineSpacing*dotFeedTime)); // Text line
+      if(prevByte == '\n') {
+        feedRows  = charHeight + lineSpacing; // Feed line
+      } else {
+        printRows = charHeight;               // Text line
+        feedRows  = lineSpacing;
+      }
       column = 0;
       c      = '\n'; // Treat wrap as newline on next pass
+      labelAdvance(charHeight + lineSpacing);
     } else {
       column++;
     }
-    timeoutSet(d);
+    timeoutDots(printRows, feedRows, 1);
     prevByte = c;
 	
   }
@@ -164,6 +372,15 @@ size_t Pos_Printer::write(uint8_t c) {
   return 1;
 }
 
+// Strings arrive here from Print; as one call, abort() can stop them.
+size_t Pos_Printer::write(const uint8_t *buffer, size_t size) {
+  Job    job(this);
+  size_t n;
+
+  for(n=0; n<size && !aborted; n++) write(buffer[n]);
+  return n;
+}
+
 void Pos_Printer::begin(uint8_t heatTime) {
 
   // The printer can't start receiving data immediately upon power up --
@@ -171,6 +388,7 @@ void Pos_Printer::begin(uint8_t heatTime) {
   // sec of uptime before printer can receive data.
   timeoutSet(500000L);
 
+  macroResident = false; // Printer may have been power cycled
   wake();
   reset();
 
@@ -218,6 +436,9 @@ void Pos_Printer::begin(uint8_t heatTime) {
   dotPrintTime   =  1; // See comments near top of file for   30000  //Fastes print speed
   dotFeedTime    =   1; // an explanation of these values.  2100     //Fastes print speed
   maxChunkHeight =   255;
+  bufferSize     =   256; // Printer receive buffer, see probeBufferSize()
+  nvWriteTime    = 100000L; // 100 ms per NV graphics command...
+  nvByteTime     =     50L; // ...plus 50 us per byte stored
   
   setDefault();
 }
@@ -225,6 +446,7 @@ void Pos_Printer::begin(uint8_t heatTime) {
 // Reset printer to default state.
 void Pos_Printer::reset() {
   writeBytes(ASCII_ESC, '@'); // Init command
+  printMode     =    0;       // ESC @ clears ESC ! modes too
   prevByte      = '\n';       // Treat as if prior line is blank
   column        =    0;
   maxColumn     =   32;
@@ -263,9 +485,9 @@ void Pos_Printer::test(){
 
 void Pos_Printer::testPage() {
   writeBytes(ASCII_DC2, 'T');
-  timeoutSet(
-    dotPrintTime * 24 * 26 +      // 26 lines w/text (ea. 24 dots high)
-    dotFeedTime * (6 * 26 + 30)); // 26 text lines (feed 6 dots) + blank line
+  timeoutDots(
+    24 * 26,      // 26 lines w/text (ea. 24 dots high)
+    6 * 26 + 30); // 26 text lines (feed 6 dots) + blank line
 }
 
 void Pos_Printer::setBarcodeHeight(uint8_t val) { // Default is 50
@@ -275,6 +497,7 @@ void Pos_Printer::setBarcodeHeight(uint8_t val) { // Default is 50
 }
 
 void Pos_Printer::printBarcode(char *text, uint8_t type) {
+  Job job(this);
   feed(1); // Recent firmware can't print barcode w/o feed first???
   writeBytes(ASCII_GS, 'H', 2);    // Print label below barcode
   writeBytes(ASCII_GS, 'w', 3);    // Barcode width 3 (0.375/1.0mm thin/thick)
@@ -290,7 +513,8 @@ void Pos_Printer::printBarcode(char *text, uint8_t type) {
     writeBytes(c = text[i++]);
   } while(c);
 #endif
-  timeoutSet((barcodeHeight + 40) * dotPrintTime);
+  timeoutDots(barcodeHeight + 40);
+  labelAdvance(barcodeHeight + 40);
   prevByte = '\n';
 }
 
@@ -398,7 +622,8 @@ void Pos_Printer::justify(char value){
 void Pos_Printer::feed(uint8_t x) {
 #if PRINTER_FIRMWARE >= 264
   writeBytes(ASCII_ESC, 'd', x);
-  timeoutSet(dotFeedTime * charHeight);
+  timeoutDots(0, charHeight);
+  labelAdvance(x * (charHeight + lineSpacing));
   prevByte = '\n';
   column   =    0;
 #else
@@ -409,13 +634,109 @@ void Pos_Printer::feed(uint8_t x) {
 // Feeds by the specified number of individual pixel rows
 void Pos_Printer::feedRows(uint8_t rows) {
   writeBytes(ASCII_ESC, 'J', rows);
-  timeoutSet(rows * dotFeedTime);
+  timeoutDots(0, rows);
+  labelAdvance(rows);
   prevByte = '\n';
   column   =    0;
 }
 
 void Pos_Printer::flush() {
-  writeBytes(ASCII_FF);
+  if(labelHeight) labelFeed();
+  else            writeBytes(ASCII_FF);
+}
+
+// === Label stock ===
+
+// Label mode for die-cut (gap) or black-mark stock.  height is the
+// printable length of one label and gap the space to the next, both in
+// dots.  Paper detection is set with FS ( L <fn=33> (paper layout,
+// distances in 0.1 mm at 8 dots/mm); the printer applies it from the
+// next power up or reset.  While on, images are clipped to the room
+// left on the current label and flush() advances to the next label.
+void Pos_Printer::labelOn(uint16_t height, uint16_t gap, bool blackMark) {
+  char     digits[8];
+  uint8_t  len = 0;
+  uint32_t pitch = (uint32_t)(height + gap) * 10 / 8;
+
+  for(uint32_t p = pitch; p; p /= 10) digits[len++] = '0' + p % 10;
+
+  writeBytes(ASCII_FS, '(', 'L');
+  writeBytes(len + 3, 0, 33, blackMark ? 50 : 49); // Label, by black mark or gap
+  while(len) writeBytes(digits[--len]);
+  writeBytes(';');
+  labelHeight = height;
+  labelGap    = gap;
+  labelRow    = 0;
+}
+
+void Pos_Printer::labelOff() {
+  writeBytes(ASCII_FS, '(', 'L');
+  writeBytes(2, 0, 33, 48); // Continuous receipt paper
+  labelHeight = 0;
+}
+
+// GS FF: feed to the start of the next label, a feed of whatever is
+// left of this label plus the gap.
+void Pos_Printer::labelFeed() {
+  uint16_t left = (labelRow < labelHeight) ? labelHeight - labelRow : 0;
+
+  writeBytes(ASCII_GS, '\f');
+  timeoutDots(0, left + labelGap);
+  labelRow = 0;
+  prevByte = '\n';
+  column   =    0;
+}
+
+// Prints one label per record.  Each label is encoded into scratch
+// (capture without transmit) while the printer is still busy with the
+// one before, then streamed out in bulk, so fetching and formatting
+// records costs no printer time.  A label too big for scratch is
+// printed directly instead.  In label mode each label ends with a feed
+// to the next; otherwise render() should end its own label.
+Pos_LabelStats Pos_Printer::printLabels(const Pos_LabelLayout &layout,
+  Pos_RecordIterator next, void *arg, Pos_JobBuffer &scratch) {
+  Pos_LabelStats stats = { 0, 0, 0 };
+  unsigned long  start = micros();
+  const void    *record;
+
+  if(layout.setup) layout.setup(*this);
+  while(!aborted && (record = next(arg))) {
+    scratch.clear();
+    // The feed is part of the label, so replay covers it too
+    beginCapture(&scratch, false);
+    layout.render(*this, record);
+    if(labelHeight) labelFeed();
+    endCapture();
+    if(scratch.overflowed()) {
+      discardCapture();
+      layout.render(*this, record);
+      if(labelHeight) labelFeed();
+    } else {
+      replay(scratch);
+    }
+    stats.labels++;
+  }
+  timeoutWait();
+  stats.elapsed = micros() - start;
+  if(stats.elapsed) stats.perMinute = (unsigned long)(stats.labels * 60000000.0 / stats.elapsed);
+  return stats;
+}
+
+uint16_t Pos_Printer::getLabelHeight() {
+  return labelHeight;
+}
+
+void Pos_Printer::labelAdvance(uint16_t dots) {
+  if(labelHeight) labelRow += dots;
+}
+
+// Rows of an image that still fit on the current label.
+int Pos_Printer::labelRoom(int rows) {
+  int room;
+
+  if(!labelHeight) return rows;
+  room = (labelRow < labelHeight) ? labelHeight - labelRow : 0;
+  return (rows < room) ? rows : room;
 }
 
 void Pos_Printer::setSize(char value){
@@ -456,175 +777,280 @@ void Pos_Printer::underlineOff() {
   writeBytes(ASCII_ESC, '-', 0);
 }
 
-void Pos_Printer::printBitmap( int w, int h, const uint8_t *bitmap, bool fromProgMem) {
-
-  int rowBytes, rowBytesClipped, rowStart, chunkHeight, x, y, i;
+// The image methods taking a pointer pick a byte source once and hand
+// off to the templated uploaders in Pos_Printer.h.
 
-  rowBytes = (w + 7) / 8; // Round up to next byte boundary
+// Header for a GS v 0 raster image; returns the row width in bytes.
+int Pos_Printer::writeRasterHeader(int w, int h) {
+  int rowBytes = (w + 7) / 8; // Round up to next byte boundary
 
   writeBytes(ASCII_GS, 'v', '0', 0, rowBytes % 256, rowBytes / 256, h % 256, h / 256);
-  i = 0;
-  for(y=0; y < h; y++) {
-    for(x=0; x < rowBytes; x++, i++) {
-      writeBytes(fromProgMem ? pgm_read_byte(bitmap + i) : *(bitmap+i));
-    }
+  return rowBytes;
+}
+
+void Pos_Printer::printBitmap( int w, int h, const uint8_t *bitmap, bool fromProgMem) {
+  if(fromProgMem) {
+    Pos_ProgmemSource source(bitmap);
+    printBitmap(w, h, source);
+  } else {
+    Pos_RamSource source(bitmap);
+    printBitmap(w, h, source);
   }
-  timeoutSet(h * dotPrintTime);
-  prevByte = '\n';
 }
 
 //this is a ridiculous vertical dot print define, not a horizontal raster.
 //to print a c header string, you must transpose (rotate and flip) and image first
 //also beware of switched height vs width when the image is transposed
 void Pos_Printer::defineBitImage( int w, int h, const uint8_t *bitmap) {
-
-  int colBytes, rowBytes, rowBytesClipped, rowStart, chunkHeight, x, y, i;
-
-  rowBytes = (w + 7) / 8; // Round up to next byte boundary
-  colBytes = (h + 7) / 8;
-
-  writeBytes(0x1D, 0x2A, rowBytes, colBytes);
-  i = 0;
-  for(y=0; y < h; y++) {
-    for(x=0; x < rowBytes; x++, i++) {
-      writeBytes(pgm_read_byte(bitmap + (i)));
-    }
-  }
-  timeoutSet(h * dotPrintTime);
-  prevByte = '\n';
+  Pos_ProgmemSource source(bitmap);
+  defineBitImage(w, h, source);
 }
 
 void Pos_Printer::printDefinedBitImage(int mode){
   writeBytes(0x1D, 0x2F, mode);
 }
 
+// Image size for FS q: width in bytes (columns, which are transposed
+// rows), then height in bytes rounded up.
+void Pos_Printer::writeNVHeader(int w, int h) {
+  int rowBytes = (w / 8),
+      colBytes = (h + 7) / 8;
+
+  writeBytes(rowBytes % 256, rowBytes / 256, colBytes % 256, colBytes / 256);
+}
+
 //this is a ridiculous vertical dot print, not a horizontal raster.
 //to print a c header string, you must transpose (rotate and flip) and image first
 //also beware of switched height vs width when the image is transposed
 //n=1 NV images
 void Pos_Printer::defineNVBitmap( int w, int h, const uint8_t *bitmap) {
-  int colBytes, rowBytes, rowBytesClipped, rowStart, chunkHeight, x, y, i;
-
-  rowBytes = (w / 8); //Round up to next byte boundary for columns, which are transposed rows
-  colBytes = (h + 7) / 8;
-
-  writeBytes(0x1C, 0x71, 1);
-  writeBytes(rowBytes % 256, rowBytes / 256, colBytes % 256, colBytes / 256);
-  i = 0;
-  for(y=0; y < colBytes; y++) {
-    for(x=0; x < w; x++, i++) {
-      writeBytes(pgm_read_byte(bitmap + i));
-    }
-  }
+  Pos_ProgmemSource source(bitmap);
+  defineNVBitmap(w, h, source);
 }
 
 //n=2 NV images
 void Pos_Printer::defineNVBitmap( int w1, int h1, const uint8_t *bitmap1, int w2, int h2, const uint8_t *bitmap2) {
-  int colBytes, rowBytes, rowBytesClipped, rowStart, chunkHeight, x, y, i;
-
-  rowBytes = (w1 / 8); //Round up to next byte boundary for columns, which are transposed rows
-  colBytes = (h1 +7)/ 8;
-
-  //write n=1 image
-  writeBytes(0x1C, 0x71, 2);
-  writeBytes(rowBytes % 256, rowBytes / 256, colBytes % 256, colBytes / 256);
-  i = 0;
-  for(y=0; y < colBytes; y++) {
-    for(x=0; x < rowBytes * 8; x++, i++) {
-      writeBytes(pgm_read_byte(bitmap1 + i));
-    }
-  }
-
-  //write n=2 image
-  rowBytes = (w2 / 8);
-  colBytes = (h2 + 7) / 8;
-  writeBytes(rowBytes % 256, rowBytes / 256, colBytes % 256, colBytes / 256);
-  i = 0;
-  for(y=0; y < colBytes; y++) {
-    for(x=0; x < rowBytes*8; x++, i++) {
-      writeBytes(pgm_read_byte(bitmap2 + i));
+  Pos_ProgmemSource source1(bitmap1), source2(bitmap2);
+  defineNVBitmap(w1, h1, source1, w2, h2, source2);
+}
+
+// Any number of NV images (FS q n) in one transaction.  FS q replaces
+// all stored images, and the printer stays busy until the flash is
+// written, so rather than guess the write time this polls the printer
+// until it answers.  Returns false if it didn't within timeout ms.
+bool Pos_Printer::defineNVBitmaps(const Pos_NVImage *images, uint8_t n, unsigned long timeout) {
+  Job job(this);
+
+  writeBytes(0x1C, 0x71, n);
+  for(uint8_t i=0; i<n && !aborted; i++) {
+    const Pos_NVImage &img = images[i];
+    uint32_t len = (uint32_t)(img.w / 8) * 8 * ((img.h + 7) / 8);
+    writeNVHeader(img.w, img.h);
+    if(img.fromProgMem) {
+      Pos_ProgmemSource source(img.bitmap);
+      writeSource(source, len);
+    } else {
+      Pos_RamSource source(img.bitmap);
+      writeSource(source, len);
     }
   }
+  if(aborted) return false;
+  return waitReady(timeout);
 }
 
 void Pos_Printer::printNVBitmap(int n, int mode){
 	writeBytes(0x1C, 0x70, n, mode);
 }
 
+// GS 8 L <fn=67>: define NV graphics, raster format, one color.  GS 8 L
+// has a 32-bit parameter count, so images over 64K need no special case.
+// Returns the number of data bytes that must follow.
+uint32_t Pos_Printer::writeNVGraphicHeader(const char *key, int w, int h) {
+  uint32_t n = (uint32_t)((w + 7) / 8) * h,
+           p = n + 11; // m fn a kc1 kc2 b xL xH yL yH c, then data
 
+  writeBytes(ASCII_GS, '8', 'L');
+  writeBytes(p, p >> 8, p >> 16, p >> 24);
+  writeBytes(48, 67, 48, key[0], key[1], 1, w % 256, w / 256);
+  writeBytes(h % 256, h / 256, 49);
+  return n;
+}
 
-void Pos_Printer::printBitmap_ada(
- int w, int h, const uint8_t *bitmap, bool fromProgMem) {
-  int rowBytes, rowBytesClipped, rowStart, chunkHeight, chunkHeightLimit,
-      x, y, i;
-
-  rowBytes        = (w + 7) / 8; // Round up to next byte boundary
-  rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
-
-  // Est. max rows to write at once, assuming 256 byte printer buffer.
-  if(dtrEnabled) {
-    chunkHeightLimit = 255; // Buffer doesn't matter, handshake!
+void Pos_Printer::defineNVGraphic(const char *key, int w, int h, const uint8_t *bitmap, bool fromProgMem) {
+  if(fromProgMem) {
+    Pos_ProgmemSource source(bitmap);
+    defineNVGraphic(key, w, h, source);
   } else {
-    chunkHeightLimit = 256 / rowBytesClipped;
-    if(chunkHeightLimit > maxChunkHeight) chunkHeightLimit = maxChunkHeight;
-    else if(chunkHeightLimit < 1)         chunkHeightLimit = 1;
+    Pos_RamSource source(bitmap);
+    defineNVGraphic(key, w, h, source);
   }
+}
 
-  for(i=rowStart=0; rowStart < h; rowStart += chunkHeightLimit) {
-    // Issue up to chunkHeightLimit rows at a time:
-    chunkHeight = h - rowStart;
-    if(chunkHeight > chunkHeightLimit) chunkHeight = chunkHeightLimit;
+// GS ( L <fn=66>: delete one NV graphic
+void Pos_Printer::deleteNVGraphic(const char *key) {
+  writeBytes(ASCII_GS, '(', 'L');
+  writeBytes(4, 0, 48, 66);
+  writeBytes(key[0], key[1]);
+  timeoutNV(0);
+}
 
-    writeBytes(ASCII_ESC, '*', chunkHeight, rowBytesClipped); //ASCII_DC2
+// GS ( L <fn=65>: delete all NV graphics
+void Pos_Printer::deleteAllNVGraphics() {
+  writeBytes(ASCII_GS, '(', 'L');
+  writeBytes(5, 0, 48, 65);
+  writeBytes('C', 'L', 'R');
+  timeoutNV(0);
+}
 
-    for(y=0; y < chunkHeight; y++) {
-      for(x=0; x < rowBytesClipped; x++, i++) {
-        timeoutWait();
-        stream->write(fromProgMem ? pgm_read_byte(bitmap + i) : *(bitmap+i));
+// GS ( L <fn=69>: print NV graphic, scaled 1 or 2 times each way.  Pass
+// the image height h (in dots) to have the print time paced.
+void Pos_Printer::printNVGraphic(const char *key, int h, uint8_t scaleX, uint8_t scaleY) {
+  writeBytes(ASCII_GS, '(', 'L');
+  writeBytes(6, 0, 48, 69);
+  writeBytes(key[0], key[1], scaleX, scaleY);
+  timeoutDots(h * scaleY);
+  labelAdvance(h * scaleY);
+  prevByte = '\n';
+}
+
+// NV flash write time: fixed cost per command plus time per byte stored.
+// As with setTimes(), the defaults are guesses; tune for your printer.
+void Pos_Printer::setNVTimes(unsigned long base, unsigned long perByte) {
+  nvWriteTime = base;
+  nvByteTime  = perByte;
+}
+
+// GS ( L <fn=51>: remaining NV graphics capacity, sent back as
+// 37h 31h <ASCII decimal> 00h.
+long Pos_Printer::NVGraphicsRemaining() {
+  uint8_t buf[12];
+  long    bytes = 0;
+  int     len, i;
+
+  writeBytes(ASCII_GS, '(', 'L');
+  writeBytes(2, 0, 48, 51);
+  if((len = readResponse(0x31, buf, sizeof(buf))) < 0) return -1;
+  for(i=0; i<len; i++) {
+    if(buf[i] >= '0' && buf[i] <= '9') bytes = bytes * 10 + (buf[i] - '0');
+  }
+  return bytes;
+}
+
+// GS ( L <fn=64>: list defined keys.  The reply comes in blocks of
+// 37h 72h <status> <kc1 kc2...> 00h, status 41h meaning another block
+// follows once acknowledged with ACK.
+int Pos_Printer::listNVGraphics(char *keys, int max) {
+  uint8_t buf[84];
+  int     count = 0, len, i;
+
+  writeBytes(ASCII_GS, '(', 'L');
+  writeBytes(4, 0, 48, 64);
+  writeBytes('K', 'C');
+  for(;;) {
+    if((len = readResponse(0x72, buf, sizeof(buf))) < 1) break;
+    for(i=1; i+1 < len; i+=2) {
+      if(count < max) {
+        keys[count * 2]     = buf[i];
+        keys[count * 2 + 1] = buf[i + 1];
+        count++;
       }
-      i += rowBytes - rowBytesClipped;
     }
-    timeoutSet(chunkHeight * dotPrintTime);
+    if(buf[0] != 0x41) break; // Last block
+    writeBytes(0x06);         // ACK: send the next one
   }
-  prevByte = '\n';
+  return count;
 }
 
-void Pos_Printer::printBitmap_ada(int w, int h, Stream *fromStream) {
-  int rowBytes, rowBytesClipped, rowStart, chunkHeight, chunkHeightLimit,
-      x, y, i, c;
-
-  rowBytes        = (w + 7) / 8; // Round up to next byte boundary
-  rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
+// Est. max rows to write at once, from the printer buffer size (256
+// bytes unless set or probed, see probeBufferSize()).
+int Pos_Printer::chunkLimit(int rowBytes) {
+  long chunkHeightLimit;
 
-  // Est. max rows to write at once, assuming 256 byte printer buffer.
   if(dtrEnabled) {
     chunkHeightLimit = 255; // Buffer doesn't matter, handshake!
   } else {
-    chunkHeightLimit = 256 / rowBytesClipped;
+    chunkHeightLimit = bufferSize / rowBytes;
     if(chunkHeightLimit > maxChunkHeight) chunkHeightLimit = maxChunkHeight;
     else if(chunkHeightLimit < 1)         chunkHeightLimit = 1;
   }
+  return chunkHeightLimit;
+}
 
-  for(rowStart=0; rowStart < h; rowStart += chunkHeightLimit) {
-    // Issue up to chunkHeightLimit rows at a time:
-    chunkHeight = h - rowStart;
-    if(chunkHeight > chunkHeightLimit) chunkHeight = chunkHeightLimit;
+void Pos_Printer::writeChunkHeader(int rows, int rowBytes) {
+  writeBytes(ASCII_ESC, '*', rows, rowBytes); //ASCII_DC2
+}
 
-    writeBytes(ASCII_ESC, '*', chunkHeight, rowBytesClipped); //ASCII_DC2
+void Pos_Printer::printBitmap_ada(
+ int w, int h, const uint8_t *bitmap, bool fromProgMem) {
+  if(fromProgMem) {
+    Pos_ProgmemSource source(bitmap);
+    printBitmap_ada(w, h, source);
+  } else {
+    Pos_RamSource source(bitmap);
+    printBitmap_ada(w, h, source);
+  }
+}
 
-    for(y=0; y < chunkHeight; y++) {
-      for(x=0; x < rowBytesClipped; x++) {
-        while((c = fromStream->read()) < 0);
-        timeoutWait();
-        stream->write((uint8_t)c);
-      }
-      for(i = rowBytes - rowBytesClipped; i>0; i--) {
-        while((c = fromStream->read()) < 0);
-      }
-    }
-    timeoutSet(chunkHeight * dotPrintTime);
+void Pos_Printer::printBitmap_ada(int w, int h, Stream *fromStream) {
+  Pos_StreamSource source(fromStream);
+  printBitmap_ada(w, h, source);
+}
+
+// Generated images: fill(row, y, arg) is called for each row as the data
+// is sent, so rows are produced at the printer's pace.  Widths beyond
+// POS_MAX_ROW_BYTES * 8 dots are clipped.
+void Pos_Printer::printBitmap(int w, int h, Pos_RowCallback fill, void *arg) {
+  if(w > POS_MAX_ROW_BYTES * 8) w = POS_MAX_ROW_BYTES * 8;
+  Pos_RowSource source(w, fill, arg);
+  printBitmap(w, h, source);
+}
+
+void Pos_Printer::printBitmap_ada(int w, int h, Pos_RowCallback fill, void *arg) {
+  if(w > POS_MAX_ROW_BYTES * 8) w = POS_MAX_ROW_BYTES * 8;
+  Pos_RowSource source(w, fill, arg);
+  printBitmap_ada(w, h, source);
+}
+
+void Pos_Printer::beginRaster(int w, uint8_t *stage, uint16_t stageSize) {
+  flushRaster(); // Finish any session left open
+  rasterRowBytes  = (w + 7) / 8; // Round up to next byte boundary
+  rasterStage     = stage;
+  rasterStageSize = stageSize;
+  if(stageSize < ((rasterRowBytes >= 48) ? 48 : rasterRowBytes))
+    rasterStage = NULL; // Not even one row fits
+}
+
+// Sends the gathered band as one ESC * block.
+void Pos_Printer::flushRaster() {
+  int      rowBytesClipped = (rasterRowBytes >= 48) ? 48 : rasterRowBytes;
+  uint16_t n = rasterRows * rowBytesClipped, i, len;
+
+  if(!rasterRows) return;
+  writeChunkHeader(rasterRows, rowBytesClipped);
+  for(i=0; i<n && !aborted; i += len) {
+    len = (n - i > POS_CHUNK_BYTES) ? POS_CHUNK_BYTES : n - i;
+    writeBuffer(rasterStage + i, len);
+  }
+  timeoutDots(rasterRows);
+  labelAdvance(rasterRows);
+  rasterRows = 0;
+}
+
+void Pos_Printer::pushRows(const uint8_t *rows, int count, bool fromProgMem) {
+  if(fromProgMem) {
+    Pos_ProgmemSource source(rows);
+    pushRows(source, count);
+  } else {
+    Pos_RamSource source(rows);
+    pushRows(source, count);
   }
-  prevByte = '\n';
+}
+
+void Pos_Printer::endRaster() {
+  flushRaster();
+  rasterRowBytes = 0;
+  rasterStage    = NULL;
+  prevByte       = '\n';
 }
 
 void Pos_Printer::printBitmap_ada(Stream *fromStream) {
@@ -640,6 +1066,161 @@ void Pos_Printer::printBitmap_ada(Stream *fromStream) {
   printBitmap_ada(width, height, fromStream);
 }
 
+// One row of Floyd-Steinberg: 7/16 of each pixel's error goes right and
+// 3/16, 5/16 and 1/16 to the row below.  The row below's share is built
+// in err behind the pixel being read, so one row of errors suffices.
+void Pos_Dither::row(uint8_t *row, int y, void *dither) {
+  Pos_Dither *d = static_cast<Pos_Dither *>(dither);
+  int16_t     v, e, right = 0, down = 0, downRight = 0;
+  int         x;
+
+  if(!y) memset(d->err, 0, (d->w + 1) * sizeof(int16_t)); // New image
+  d->gray(d->line, y, d->arg);
+  memset(row, 0, (d->w + 7) / 8);
+  for(x=0; x<d->w; x++) {
+    v = d->line[x] + d->err[x + 1] + right;
+    if(v < 128) {
+      row[x >> 3] |= 0x80 >> (x & 7); // Black
+      e = v;
+    } else {
+      e = v - 255;
+    }
+    right       = e * 7 / 16;
+    d->err[x]   = down + e * 3 / 16;
+    down        = downRight + e * 5 / 16;
+    downRight   = e / 16;
+  }
+  d->err[d->w] = down;
+}
+
+#if defined(__SSE2__)
+// movemask puts the first pixel in the low bit; rows want it in the high.
+static uint8_t reverseBits(uint8_t b) {
+  b = (b >> 4) | (b << 4);
+  b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+  return ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+}
+#endif
+
+// Packs a row against 16 thresholds, repeated across it (x & 15).
+static uint16_t packRow(uint8_t *row, const uint8_t *gray, int w, const uint8_t *limits) {
+  uint16_t dots = 0;
+  uint8_t  bits;
+  int      x = 0, i;
+
+#if defined(__SSE2__)
+  // No unsigned byte compare in SSE2: flip the sign bits and compare signed.
+  const __m128i flip  = _mm_set1_epi8((char)0x80),
+                limit = _mm_xor_si128(_mm_loadu_si128((const __m128i *)limits), flip);
+  for(; x + 16 <= w; x += 16) {
+    __m128i  g = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(gray + x)), flip);
+    unsigned m = _mm_movemask_epi8(_mm_cmplt_epi8(g, limit));
+    row[x >> 3]       = reverseBits(m);
+    row[(x >> 3) + 1] = reverseBits(m >> 8);
+    dots += __builtin_popcount(m);
+  }
+#endif
+  for(; x < w; x += 8) {
+    for(bits=i=0; i<8; i++) {
+      bits <<= 1;
+      if(x + i < w && gray[x + i] < limits[(x + i) & 15]) {
+        bits |= 1;
+        dots++;
+      }
+    }
+    row[x >> 3] = bits;
+  }
+  return dots;
+}
+
+uint16_t Pos_packRow(uint8_t *row, const uint8_t *gray, int w, uint8_t threshold) {
+  uint8_t limits[16];
+
+  memset(limits, threshold, sizeof(limits));
+  return packRow(row, gray, w, limits);
+}
+
+// 16x16 blue-noise thresholds (void-and-cluster ranks scaled to 1-255):
+// dots of any density come out evenly spread with no visible grid.
+static const uint8_t PROGMEM blueNoise[16 * 16] = {
+  122,  54, 149,  18, 199,  45, 163,  24, 131, 200, 171,  78, 223, 198, 103, 217,
+    5, 188, 224, 109,  77, 119, 242, 100,   9, 250,  37, 124, 160,  60,  22, 168,
+   75, 158,  95,  36, 136, 210,  58, 192, 151,  67, 214,  94, 235, 181, 134, 239,
+  205,  44, 249, 176, 233,   1, 167,  88, 116, 186,  53, 142,   8,  71,  33, 110,
+  143,  14, 126,  70,  25, 145,  42, 222,  27, 238,  17, 175, 117, 254, 194,  89,
+   57, 216, 187, 115, 196,  83, 253, 127, 204, 105, 164,  82, 209,  46, 154, 226,
+   28, 104, 162,  48, 229,  99, 173,  55,  73, 139,  38, 227, 129,  98,   1, 172,
+  232,  79, 246,   7, 150, 208,  19, 159,   4, 195, 245,  63,  23, 191,  68, 135,
+   40, 201, 132,  91,  35,  65, 120, 183, 220, 113,  92, 180, 157, 215, 241, 111,
+  166,  15,  62, 177, 218, 137, 247,  87,  49,  30, 144,  10, 121,  52,  85, 184,
+  211, 123, 152, 240, 190, 107,  11, 234, 153, 206, 230,  76, 252,  32, 147,  20,
+  248,  74, 101,  51,  26,  80,  41, 169,  69, 102, 133, 197, 174, 106, 221,  96,
+   43, 193,   2, 225, 165, 146, 202, 125, 189,  21,  56,  39, 161,   6, 130,  61,
+  156, 236, 112, 128, 213,  59, 255, 114,   3, 237, 212,  93,  66, 231, 203, 179,
+  138,  31, 170,  84,  12,  97,  34, 178,  86, 155, 140, 244, 185, 118,  81,  16,
+   90, 207,  64, 243, 182, 141, 228,  72, 219,  50, 108,  13,  29, 148,  47, 251
+};
+
+// Each pixel is compared with its tile entry alone, so rows and bands
+// can be done in any order and no error buffers are needed.
+uint16_t Pos_blueNoiseRow(uint8_t *row, const uint8_t *gray, int w, int y) {
+  uint8_t limits[16];
+
+  memcpy_P(limits, blueNoise + (y & 15) * 16, sizeof(limits));
+  return packRow(row, gray, w, limits);
+}
+
+// Reads one ASCII number from a PBM header, skipping whitespace and
+// # comments.  Returns -1 at the end of the file or on anything else.
+static long pbmNumber(Stream *file) {
+  long n = -1;
+  int  c;
+
+  for(;;) {
+    if((c = file->read()) < 0) return -1;
+    if(c == '#') {
+      while((c = file->read()) >= 0 && c != '\n');
+    } else if(c > ' ') {
+      break;
+    }
+  }
+  for(n=0; c >= '0' && c <= '9'; c = file->read()) n = n * 10 + (c - '0');
+  return (c <= ' ') ? n : -1; // One whitespace byte ends the number
+}
+
+// Prints an image file, e.g. from an SD card: binary PBM ("P4", whose
+// rows match the printer's raster format), or the 4-byte width/height
+// header format written by processing/ and ruby/image_to_file.  Rows are
+// read one at a time and the image ends at the first short read, so a
+// truncated file prints the whole rows it has, an empty one nothing.
+// (available() is no help here: an SD File caps it at 32767.)
+void Pos_Printer::printBitmapFile(Stream *file) {
+  Job     job(this);
+  uint8_t band[POS_CHUNK_BYTES * 4], row[48];
+  long    w, h, rowBytes, x;
+  int     a, b, c;
+
+  a = file->read();
+  b = file->read();
+  if(a == 'P' && b == '4') {
+    if((w = pbmNumber(file)) <= 0 || (h = pbmNumber(file)) <= 0) return;
+  } else {
+    if(a < 0 || b < 0 || (c = file->read()) < 0 || (h = file->read()) < 0) return;
+    w = a | (b << 8);
+    h = c | (h << 8);
+    if(!w || !h) return;
+  }
+  rowBytes = (w + 7) / 8;
+  beginRaster((w > 384) ? 384 : w, band, sizeof(band)); // 384 pixels max width
+  for(; h > 0 && !aborted; h--) {
+    for(x=0; x<rowBytes && (c = file->read()) >= 0; x++)
+      if(x < (long)sizeof(row)) row[x] = c;
+    if(x < rowBytes) break; // End of file
+    pushRows(row);
+  }
+  endRaster();
+}
+
 // Take the printer offline. Print commands sent after this will be
 // ignored until 'online' is called.
 void Pos_Printer::offline(){
@@ -685,6 +1266,130 @@ void Pos_Printer::wake() {
 #endif
 }
 
+// Reads a reply of the form 37h id <data> 00h, as sent for GS ( L and
+// similar queries, into buf (at most max bytes kept).  Returns the data
+// length, or -1 if no complete reply arrives within timeout milliseconds.
+int Pos_Printer::readResponse(uint8_t id, uint8_t *buf, int max, unsigned long timeout) {
+  unsigned long start = millis();
+  int           c, len = 0, state = 0; // 0 = want header, 1 = want id, 2 = data
+
+  while((millis() - start) < timeout) {
+    if(!stream->available()) {
+      yield();
+      continue;
+    }
+    c = stream->read();
+    if(state == 2) {
+      if(c == 0) return len;
+      if(len < max) buf[len++] = c;
+    } else if(c == 0x37) {
+      state = 1;
+    } else {
+      state = (state == 1 && c == id) ? 2 : 0;
+    }
+  }
+  return -1;
+}
+
+// Polls the printer with the real-time status request DLE EOT 1 until
+// it answers or timeout milliseconds pass.  A busy printer (e.g. one
+// writing NV memory) only answers once it's done, so this marks the
+// real end of a long operation.  Clears any pending pacing delay.
+bool Pos_Printer::waitReady(unsigned long timeout) {
+  unsigned long start = millis(), sent;
+  int           c;
+
+  timeoutWait(); // Let the request follow any data still being paced out
+  while(stream->available()) stream->read(); // Drop stale replies
+  while((millis() - start) < timeout) {
+    stream->write(0x10);
+    stream->write(0x04);
+    stream->write(1);
+    for(sent = millis(); (millis() - sent) < 500; yield()) {
+      if(!stream->available()) continue;
+      c = stream->read();
+      if((c & 0x93) == 0x12) { // Fixed bits of a printer status byte
+        timeoutSet(0);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Candidate rates for negotiateBaud(), slowest first.
+static const unsigned long baudRates[] = { 9600, 19200, 38400, 57600, 115200 };
+
+// Finds the printer's current rate, then moves it to the fastest of the
+// candidate rates that gives a stable link.  setPort(baud) must reopen
+// the port (e.g. Serial1.begin(baud)).  A rate is found by sending a
+// status request and waiting for a valid reply; the printer is moved
+// with the GS ( E user setting commands, which store the new rate in
+// the printer, so save the result and pass it to setBaudRate() at the
+// next startup.  Returns the rate in use, 0 if the printer never answered.
+unsigned long Pos_Printer::negotiateBaud(Pos_BaudCallback setPort,
+  const unsigned long *rates, uint8_t n) {
+  unsigned long current = 0;
+  int           i;
+
+  if(!rates) {
+    rates = baudRates;
+    n     = sizeof(baudRates) / sizeof(baudRates[0]);
+  }
+  timeoutSet(0); // May run before begin()
+
+  if(!(current = findBaud(setPort, rates, n))) return 0;
+  for(i=n-1; i>=0 && rates[i] > current; i--) {
+    if(switchBaud(setPort, rates[i])) return rates[i];
+    // Rate refused or link unstable: find the printer again, wherever
+    // it ended up, and carry on with the slower candidates.
+    if(!(current = findBaud(setPort, rates, n))) return 0;
+  }
+  return current;
+}
+
+// Tries each rate until the printer answers a status request; leaves the
+// port there.  Returns the rate, or 0 if none worked.
+unsigned long Pos_Printer::findBaud(Pos_BaudCallback setPort,
+  const unsigned long *rates, uint8_t n) {
+  for(uint8_t i=0; i<n; i++) {
+    setPort(rates[i]);
+    setBaudRate(rates[i]);
+    if(waitReady(500)) return rates[i];
+  }
+  return 0;
+}
+
+// Moves the printer to baud, following it with the port; true if three
+// status requests in a row are then answered.
+bool Pos_Printer::switchBaud(Pos_BaudCallback setPort, unsigned long baud) {
+  char    digits[8];
+  uint8_t len = 0, i;
+
+  for(unsigned long b = baud; b; b /= 10) digits[len++] = '0' + b % 10;
+
+  writeBytes(ASCII_GS, '(', 'E');          // <fn=1> enter user setting mode
+  writeBytes(3, 0, 1);
+  writeBytes('I', 'N');
+  writeBytes(ASCII_GS, '(', 'E');          // <fn=11> serial settings,
+  writeBytes(len + 2, 0, 11, 1);           // a=1: baud rate as ASCII
+  while(len) writeBytes(digits[--len]);
+  writeBytes(ASCII_GS, '(', 'E');          // <fn=2> end session: store
+  writeBytes(4, 0, 2);                     // the settings and restart
+  writeBytes('O', 'U', 'T');
+  timeoutWait();
+  stream->flush();                         // Out before the port changes
+
+  setPort(baud);
+  setBaudRate(baud);
+  delay(2000);                             // Printer restart
+  while(stream->available()) stream->read(); // Setting mode replies, noise
+  for(i=0; i<3; i++) {
+    if(!waitReady(500)) return false;
+  }
+  return true;
+}
+
 // Check the status of the paper using the printer's self reporting
 // ability.  Returns true for paper, false for no paper.
 // Might not work on all printers!
@@ -718,6 +1423,62 @@ void Pos_Printer::setMaxChunkHeight(int val) {
   maxChunkHeight = val;
 }
 
+// Printer receive buffer size in bytes, e.g. as saved from an earlier
+// probeBufferSize().
+void Pos_Printer::setBufferSize(unsigned long bytes) {
+  bufferSize = bytes;
+}
+
+unsigned long Pos_Printer::getBufferSize() {
+  return bufferSize;
+}
+
+// Measures the printer's receive buffer by holding the printer busy,
+// printing nothing, and sending no-op NULs until it signals that the
+// buffer is full, on the DTR pin (if one was given to the constructor)
+// or with XOFF (if the printer uses XON/XOFF).  The printer is held by
+// running a macro that prints nothing (it re-selects the current print
+// mode) with a long pause; this replaces any stored macro.  An empty
+// macro won't do: GS : GS : leaves no macro, and GS ^ then does nothing.
+// The pause is sized to outlast sending maxBytes; the library stays paced
+// until the pause is over.  Returns the size found, which is also used
+// for chunking from then on, or 0 if no busy signal was seen.
+unsigned long Pos_Printer::probeBufferSize(unsigned long maxBytes) {
+  unsigned long hold = (maxBytes + 256) * byteTime / 4 * 5, // us, 25% spare
+                start, n;
+  uint8_t       runs = 2, pause;
+  int           c;
+  bool          full = false;
+
+  if(hold > 25500000L) runs += hold / 25500000L; // GS ^ pause tops out at 25.5 s
+  pause = (hold / (runs - 1) + 99999L) / 100000L;
+
+  writeBytes(ASCII_GS, ':'); // Do-nothing macro...
+  writeBytes(ASCII_ESC, '!', printMode);
+  writeBytes(ASCII_GS, ':');
+  writeBytes(ASCII_GS, '^', runs, pause); // ...run with pauses between
+  writeBytes(0);
+  macroResident = false;
+  timeoutWait();
+  start = micros();
+
+  while(stream->available()) stream->read();
+  for(n=0; n<maxBytes && !full; n++) {
+    stream->write((uint8_t)0);
+    stream->flush(); // Count bytes that have left, not queued ones
+    if(dtrPin < 255 && digitalRead(dtrPin) == HIGH) full = true;
+    while(stream->available()) {
+      if((c = stream->read()) == 0x13) full = true; // XOFF
+    }
+  }
+
+  hold = (runs - 1) * pause * 100000L;
+  if((micros() - start) < hold) resumeTime = start + hold;
+  if(!full) return 0;
+  bufferSize = n;
+  return n;
+}
+
 // These commands work only on printers w/recent firmware ------------------
 
 // Alters some chars in ASCII 0x23-0x7E range; see datasheet
@@ -744,6 +1505,379 @@ void Pos_Printer::setCharSpacing(int spacing) {
 // Cut paper.
 void Pos_Printer::cut(){
   writeBytes(ASCII_GS, 'V', 0);
+  if(completionOnCut) requestCompletion();
+}
+
+// Cut paper, leaving one point uncut.
+void Pos_Printer::partialCut(){
+  writeBytes(ASCII_GS, 'V', 1);
+}
+
+void Pos_Printer::trackCompletion(bool on, Pos_CompletionCallback done, void *arg) {
+  completionOnCut    = on;
+  completionCallback = done;
+  completionArg      = arg;
+}
+
+// GS ( H <fn=48>: the printer replies 37h 22h d1..d4 00h, echoing the
+// four ASCII digits, after printing everything sent before it.  Tracking
+// starts in noteCompletion(), once the request is actually sent.
+uint16_t Pos_Printer::requestCompletion() {
+  if(++completionId > 9999) completionId = 0;
+  uint8_t cmd[11] = { ASCII_GS, '(', 'H', 6, 0, 48, 48,
+    (uint8_t)('0' + completionId / 1000), (uint8_t)('0' + completionId / 100 % 10),
+    (uint8_t)('0' + completionId / 10 % 10), (uint8_t)('0' + completionId % 10) };
+  writeBuffer(cmd, sizeof(cmd));
+  return completionId;
+}
+
+bool Pos_Printer::completionPending() {
+  int c;
+
+  while(completionCount && stream->available()) {
+    c = stream->read();
+    // Digits first: '7' is 37h, the same as the reply header.
+    if(replyState >= 2 && replyState < 6) {
+      if(c >= '0' && c <= '9') {
+        replyId = replyId * 10 + (c - '0');
+        replyState++;
+      } else {
+        replyState = 0;
+      }
+    } else if(replyState == 6) {
+      if(c == 0) {
+        // Replies come in order, so any older request went unanswered
+        for(uint8_t i=0; i<completionCount; i++) {
+          if(completionIds[i] != replyId) continue;
+          completionElapsed = micros() - completionStarts[i];
+          i++;
+          completionCount -= i;
+          memmove(completionIds, completionIds + i,
+                  completionCount * sizeof(completionIds[0]));
+          memmove(completionStarts, completionStarts + i,
+                  completionCount * sizeof(completionStarts[0]));
+          if(completionCallback)
+            completionCallback(replyId, completionElapsed, completionArg);
+          break;
+        }
+      }
+      replyState = 0;
+    } else if(c == 0x37) {
+      replyState = 1;
+    } else if(replyState == 1) {
+      replyState = (c == 0x22) ? 2 : 0;
+      replyId    = 0;
+    } else {
+      replyState = 0;
+    }
+  }
+  return completionCount > 0;
+}
+
+bool Pos_Printer::waitCompletion(unsigned long timeout) {
+  unsigned long start = millis();
+
+  while(completionPending()) {
+    if((millis() - start) >= timeout) return false;
+    yield();
+  }
+  return true;
+}
+
+unsigned long Pos_Printer::completionTime() {
+  return completionElapsed;
+}
+
+// GS : starts and ends macro definition.  Issuing it while a macro is
+// stored replaces that macro.
+void Pos_Printer::beginMacro() {
+  writeBytes(ASCII_GS, ':');
+  macroRecording = true;
+  macroResident  = false;
+  macroTime      = 0;
+}
+
+void Pos_Printer::endMacro() {
+  if(!macroRecording) return;
+  macroRecording = false;
+  writeBytes(ASCII_GS, ':');
+  macroResident  = true;
+}
+
+bool Pos_Printer::macroDefined() {
+  return macroResident;
+}
+
+// GS ^ r t m: run the macro r times with t * 100 ms between runs
+// (m = 0, no wait for the feed button).
+void Pos_Printer::runMacro(uint8_t count, uint8_t interval) {
+  if(!macroResident || !count) return;
+  writeBytes(ASCII_GS, '^', count, interval);
+  writeBytes(0);
+  unsigned long n[PACE_UNITS] = { (count - 1) * interval * 100000UL };
+  n[PACE_MACRO] = count;
+  timeoutUnits(n);
+  prevByte = '\n';
+  column   =    0;
+}
+
+// Capture tees everything the library sends into sink, as CAPTURE_DATA
+// records interleaved with the pacing the library applied, kept as
+// CAPTURE_PACE dot rows and NV bytes rather than time where it can be.
+// With transmit false the job is only encoded: nothing is sent and no
+// time is spent waiting.  replay() plays a captured job back with the
+// same pacing, without re-running the code that built it.  With inPlace,
+// images printed from RAM are recorded by address instead of copied:
+// far smaller captures, but the image must stay put until replayed, and
+// such a job can only be replayed from memory on this same device.
+void Pos_Printer::beginCapture(Print *sink, bool transmit, bool inPlace) {
+  captureFlush();
+  captureSink     = sink;
+  captureTransmit = transmit;
+  captureInPlace  = inPlace;
+  captureCount    = 0;
+  lastWrite       = 0;
+  captureLabelRow = labelRow;
+  captureColumn   = column;
+  capturePrevByte = prevByte;
+}
+
+void Pos_Printer::endCapture() {
+  captureFlush();
+  captureSink = NULL;
+}
+
+// Encoding a job moves the label position and text column on as if it
+// had printed.  For a capture that won't be replayed (e.g. it overflowed
+// and the job is to be printed directly instead), call this after
+// endCapture() to put them back.
+void Pos_Printer::discardCapture() {
+  labelRow = captureLabelRow;
+  column   = captureColumn;
+  prevByte = capturePrevByte;
+}
+
+void Pos_Printer::captureWrite32(unsigned long x) {
+  captureSink->write(x);
+  captureSink->write(x >> 8);
+  captureSink->write(x >> 16);
+  captureSink->write(x >> 24);
+}
+
+// 7 bits a byte, low first, top bit set on all but the last: most pace
+// counts are a few dozen dot rows, so one byte.
+void Pos_Printer::captureWriteCount(unsigned long x) {
+  for(; x >= 0x80; x >>= 7) captureSink->write((uint8_t)(x | 0x80));
+  captureSink->write((uint8_t)x);
+}
+
+// Writes out any data staged by emit() as one CAPTURE_DATA record.
+void Pos_Printer::captureFlush() {
+  if(!captureSink || !captureCount) return;
+  captureSink->write(CAPTURE_DATA);
+  captureSink->write(captureCount);
+  captureSink->write(captureStage, captureCount);
+  captureCount = 0;
+}
+
+// RAM images can be sent in place (see beginCapture()), so they get
+// their own overload of the template in the header.
+void Pos_Printer::writeSource(Pos_Source<Pos_RamSource> &source, uint32_t n) {
+  Pos_RamSource &src = static_cast<Pos_RamSource &>(source);
+  uint16_t       len;
+
+  while(n && !aborted) {
+    len = (n > POS_CHUNK_BYTES) ? POS_CHUNK_BYTES : n;
+    writeBuffer(src.take(len), len, true);
+    n -= len;
+  }
+}
+
+void Pos_Printer::replay(const uint8_t *job, uint32_t len) {
+  Job guard(this);
+
+  replayPos = 0;
+  while(!replayStep(job, len)) yield();
+}
+
+void Pos_Printer::replay(Pos_JobBuffer &job) {
+  replay(job.data(), job.length());
+}
+
+static unsigned long get32(const uint8_t *p) {
+  return (unsigned long)p[0]         | ((unsigned long)p[1] << 8) |
+        ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// Units set in a CAPTURE_PACE mask, i.e. how many counts follow it
+static uint8_t paceCount(uint8_t mask) {
+  uint8_t n = 0;
+  for(; mask; mask >>= 1) n += mask & 1;
+  return n;
+}
+
+// Unpacks a CAPTURE_PACE record's counts (as captureWriteCount() wrote
+// them, from the len bytes at p) into units[PACE_UNITS].  Returns the
+// bytes they took, 0 if the record is cut short.
+static uint32_t paceUnits(uint8_t mask, const uint8_t *p, uint32_t len, unsigned long *units) {
+  uint32_t i = 0;
+  uint8_t  shift;
+
+  for(uint8_t unit=0; unit<PACE_UNITS; unit++) {
+    units[unit] = 0;
+    if(!(mask & (1 << unit))) continue;
+    for(shift=0; ; shift += 7) {
+      if(i >= len) return 0;
+      units[unit] |= (unsigned long)(p[i] & 0x7F) << shift;
+      if(!(p[i++] & 0x80)) break;
+    }
+  }
+  return i;
+}
+
+void Pos_Printer::beginReplay() {
+  replayPos = 0;
+}
+
+// Non-blocking replay: sends records from replayPos on for as long as
+// the printer is ready, and returns true once the whole job is out.
+bool Pos_Printer::replayStep(const uint8_t *job, uint32_t len) {
+  unsigned long units[PACE_UNITS];
+  uint32_t      used;
+  uint8_t       n;
+
+  while(replayPos < len && ready()) {
+    if(aborted) {
+      replayPos = len;
+    } else if(job[replayPos] == CAPTURE_DATA && replayPos + 2 <= len &&
+              replayPos + 2 + job[replayPos + 1] <= len) {
+      n = job[replayPos + 1];
+      writeBuffer(job + replayPos + 2, n);
+      replayPos += 2 + n;
+    } else if(job[replayPos] == CAPTURE_REF &&
+              replayPos + 2 + sizeof(const uint8_t *) <= len) {
+      const uint8_t *ref;
+      memcpy(&ref, job + replayPos + 2, sizeof(ref));
+      writeBuffer(ref, job[replayPos + 1]);
+      replayPos += 2 + sizeof(ref);
+    } else if(job[replayPos] == CAPTURE_WAIT && replayPos + 5 <= len) {
+      timeoutSet(get32(job + replayPos + 1));
+      replayPos += 5;
+    } else if(job[replayPos] == CAPTURE_PACE && replayPos + 2 <= len &&
+              (used = paceUnits(job[replayPos + 1], job + replayPos + 2,
+                                len - replayPos - 2, units))) {
+      timeoutUnits(units);
+      replayPos += 2 + used;
+    } else {
+      replayPos = len; // Truncated or not a captured job
+    }
+  }
+  if(replayPos < len) return false;
+  prevByte = '\n';
+  column   =    0;
+  return true;
+}
+
+// Streams one captured job (encoded once, e.g. with beginCapture(&buf,
+// false)) to several printers at the same time.  Each printer keeps its
+// own pacing, converting the job's dot rows and NV bytes with its own
+// setTimes() and setNVTimes(); whichever is ready gets its next records,
+// so the slowest printer sets the total time, not the sum of them all.
+void Pos_Printer::broadcast(Pos_Printer **printers, uint8_t n, const uint8_t *job, uint32_t len) {
+  uint8_t i, busy;
+
+  for(i=0; i<n; i++) {
+    printers[i]->jobDepth++; // As a Job scope, so abort() can stop one
+    printers[i]->replayPos = 0;
+  }
+  do {
+    for(i=busy=0; i<n; i++) {
+      if(!printers[i]->replayStep(job, len)) busy++;
+    }
+    if(busy) yield();
+  } while(busy);
+  for(i=0; i<n; i++) {
+    if(!--printers[i]->jobDepth) printers[i]->aborted = false;
+  }
+}
+
+void Pos_Printer::broadcast(Pos_Printer **printers, uint8_t n, Pos_JobBuffer &job) {
+  broadcast(printers, n, job.data(), job.length());
+}
+
+// Replay from a Stream, e.g. a job captured to an SD card file.  Stops
+// at the end of the stream or at anything that isn't a record.
+void Pos_Printer::replay(Stream *job) {
+  Job     guard(this);
+  uint8_t buf[255];
+  int     c, n;
+
+  while(!aborted && (c = job->read()) >= 0) {
+    if(c == CAPTURE_DATA) {
+      if((n = job->read()) < 0) break;
+      if(job->readBytes(buf, n) != (size_t)n) break;
+      writeBuffer(buf, n);
+    } else if(c == CAPTURE_WAIT) {
+      if(job->readBytes(buf, 4) != 4) break;
+      timeoutSet(get32(buf));
+    } else if(c == CAPTURE_PACE) {
+      unsigned long units[PACE_UNITS];
+      int           mask, counts;
+      if((mask = job->read()) < 0) break;
+      // Gather the counts' bytes, then unpack them as replayStep() does
+      for(n=0, counts=paceCount(mask); counts && n<(int)sizeof(buf); ) {
+        if((c = job->read()) < 0) break;
+        buf[n++] = c;
+        if(!(c & 0x80)) counts--;
+      }
+      if(counts || !paceUnits(mask, buf, n, units)) break;
+      timeoutUnits(units);
+    } else {
+      break;
+    }
+  }
+  prevByte = '\n';
+  column   =    0;
+}
+
+void Pos_Printer::abort() {
+  requestAbort();
+  abortFlush();
+}
+
+// Interrupt-safe: touches only the two flags.  Nothing is written here,
+// as the main program may be inside stream->write() with a block that
+// must reach the printer whole before the clear command follows it.
+void Pos_Printer::requestAbort() {
+  if(jobDepth) aborted = true; // Drop the rest of the call in progress
+  abortPending = true;
+}
+
+// Sends the clear for a pending abort, between writes.
+void Pos_Printer::abortFlush() {
+  // DLE DC4 fn=8 d1..d7 (fixed "clear buffer" signature)
+  static const uint8_t clearBuffers[] = { 0x10, 0x14, 8, 1, 3, 20, 1, 6, 2, 8 };
+
+  if(!abortPending) return;
+  abortPending = false;
+  // Real-time: acted on as received, ahead of anything still buffered.
+  stream->write(clearBuffers, sizeof(clearBuffers));
+
+  // Whatever was cut off, the printer now takes commands from a clean
+  // slate.  Re-send the print mode so it matches our shadow copy.
+  stream->write(ASCII_ESC);
+  stream->write('!');
+  stream->write(printMode);
+  rasterRowBytes = 0;
+  rasterRows     = 0;
+  if(macroRecording) {
+    macroRecording = false;
+    macroResident  = false;
+  }
+  prevByte   = '\n';
+  column     =    0;
+  labelRow   =    0; // Assume the next job starts a fresh label
+  resumeTime = micros() + 13 * byteTime;
 }
 
 // Make printer beep
@@ -761,6 +1895,7 @@ void Pos_Printer::setBeep(int sec) {
 // Standard ESC/POS commands that work only on printers that support these commands
 
 void Pos_Printer::printQRcode(char *text, uint8_t errCorrect, uint8_t moduleSize, uint8_t model, uint16_t timeoutQR) {	//Store data and print QR Code
+	Job job(this);
 	
 	//Set QR-Code model
 	//Range
@@ -813,3 +1948,325 @@ void Pos_Printer::reprintQRcode(uint16_t timeoutQR) { //Reprint a previously pri
 	prevByte = '\n'; /// Treat as if prior line is blank
 
 }
+
+// === Open jobs ===
+
+Pos_OpenJob::Pos_OpenJob(Pos_Printer &p, uint8_t *buf, uint32_t size) :
+  printer(p), queue(buf, size), mark(0), appending(false), closed(false),
+  dropped(false) {
+}
+
+void Pos_OpenJob::beginAppend() {
+  // Reclaim what has been sent; replayStep() stops on record boundaries.
+  queue.discard(printer.replayPos);
+  printer.replayPos = 0;
+  mark = queue.length();
+  printer.beginCapture(&queue, false);
+  appending = true;
+}
+
+bool Pos_OpenJob::endAppend() {
+  printer.endCapture();
+  appending = false;
+  dropped   = queue.overflowed();
+  if(dropped) { // A partial append would print garbage; drop all of it
+    queue.truncate(mark);
+    printer.discardCapture();
+  }
+  service();
+  return !dropped;
+}
+
+void Pos_OpenJob::close() {
+  closed = true;
+}
+
+// Column and last byte stay as the appends left them: the job's next
+// line may continue one that has only partly gone out.
+bool Pos_OpenJob::service() {
+  uint8_t column = printer.column, prevByte = printer.prevByte;
+  bool    done;
+
+  if(appending) return false;
+  done             = printer.replayStep(queue.data(), queue.length());
+  printer.column   = column;
+  printer.prevByte = prevByte;
+  if(done) {
+    queue.clear();
+    printer.replayPos = 0;
+    return closed;
+  }
+  return false;
+}
+
+bool Pos_OpenJob::overflowed() {
+  return dropped;
+}
+
+// === Ticket coalescing ===
+
+Pos_Coalescer::Pos_Coalescer(Pos_Printer &p, uint8_t *buf, uint32_t size,
+  unsigned long window, uint8_t separator, uint8_t feedLines) :
+  printer(p), queue(buf, size), window(window), separator(separator),
+  feedLines(feedLines), pending(0) {
+}
+
+static void ruleRow(uint8_t *row, int, void *) {
+  memset(row, 0xFF, 48);
+}
+
+void Pos_Coalescer::separate() {
+  if(separator == POS_SEPARATE_PARTIAL_CUT) {
+    printer.feed(2);
+    printer.partialCut();
+  } else {
+    printer.feed(1);
+    printer.printBitmap_ada(384, 2, ruleRow);
+    printer.feed(1);
+  }
+}
+
+void Pos_Coalescer::submit(Pos_TicketCallback render, const void *arg) {
+  uint32_t mark = queue.length();
+
+  printer.beginCapture(&queue, false);
+  if(pending) separate();
+  render(printer, arg);
+  printer.endCapture();
+
+  if(queue.overflowed()) {
+    // Doesn't fit behind the others: print them, then start afresh
+    printer.discardCapture();
+    queue.truncate(mark);
+    flush();
+    printer.beginCapture(&queue, false);
+    render(printer, arg);
+    printer.endCapture();
+    if(queue.overflowed()) { // Too big to queue at all
+      printer.discardCapture();
+      queue.clear();
+      render(printer, arg);
+      printer.feed(feedLines);
+      printer.cut();
+      return;
+    }
+  }
+  if(!pending++) windowStart = millis();
+}
+
+void Pos_Coalescer::service() {
+  if(pending && (millis() - windowStart) >= window) flush();
+}
+
+void Pos_Coalescer::flush() {
+  if(!pending) return;
+  printer.replay(queue);
+  printer.feed(feedLines);
+  printer.cut();
+  queue.clear();
+  pending = 0;
+}
+
+// === Print spool ===
+
+// Each job: id (2 bytes), priority, record length (4 bytes, all little-
+// endian), then the captured records.
+#define SPOOL_HEADER 7
+#define SPOOL_NONE   0xFFFFFFFF
+
+Pos_Spool::Pos_Spool(Pos_Printer &p, uint8_t *buf, uint32_t size) :
+  printer(p), buf(buf), size(size), len(0), current(SPOOL_NONE), nextId(1) {
+}
+
+uint32_t Pos_Spool::jobLength(uint32_t at) {
+  return (uint32_t)buf[at + 3]         | ((uint32_t)buf[at + 4] << 8) |
+        ((uint32_t)buf[at + 5] << 16) | ((uint32_t)buf[at + 6] << 24);
+}
+
+uint16_t Pos_Spool::add(Pos_TicketCallback render, const void *arg, bool inPlace,
+  const uint8_t *escpos, uint32_t n, uint8_t priority) {
+  uint16_t id;
+
+  if(size - len <= SPOOL_HEADER) return 0;
+  Pos_JobBuffer job(buf + len + SPOOL_HEADER, size - len - SPOOL_HEADER);
+  printer.beginCapture(&job, false, inPlace);
+  if(render) {
+    render(printer, arg);
+  } else { // As is: print() and write() would treat the bytes as text
+    Pos_RamSource source(escpos);
+    printer.writeSource(source, n);
+  }
+  printer.endCapture();
+  if(job.overflowed()) { // No room; the caller may retry later
+    printer.discardCapture();
+    return 0;
+  }
+
+  id = nextId++;
+  if(!nextId) nextId = 1;
+  n  = job.length();
+  buf[len]     = id;
+  buf[len + 1] = id >> 8;
+  buf[len + 2] = priority;
+  buf[len + 3] = n;
+  buf[len + 4] = n >> 8;
+  buf[len + 5] = n >> 16;
+  buf[len + 6] = n >> 24;
+  len += SPOOL_HEADER + n;
+  return id;
+}
+
+uint16_t Pos_Spool::submit(Pos_TicketCallback render, const void *arg, uint8_t priority,
+  bool inPlace) {
+  return add(render, arg, inPlace, NULL, 0, priority);
+}
+
+uint16_t Pos_Spool::submit(const uint8_t *escpos, uint32_t n, uint8_t priority) {
+  return add(NULL, NULL, false, escpos, n, priority);
+}
+
+uint32_t Pos_Spool::find(uint16_t id) {
+  uint32_t at;
+
+  for(at=0; at<len; at += SPOOL_HEADER + jobLength(at)) {
+    if((buf[at] | (buf[at + 1] << 8)) == id) return at;
+  }
+  return SPOOL_NONE;
+}
+
+void Pos_Spool::remove(uint32_t at) {
+  uint32_t end = at + SPOOL_HEADER + jobLength(at);
+
+  memmove(buf + at, buf + end, len - end);
+  len -= end - at;
+  if(current != SPOOL_NONE && current > at) current -= end - at;
+}
+
+uint8_t Pos_Spool::status(uint16_t id) {
+  uint32_t at = find(id);
+
+  if(at == SPOOL_NONE) return POS_JOB_DONE;
+  return (at == current) ? POS_JOB_PRINTING : POS_JOB_QUEUED;
+}
+
+uint16_t Pos_Spool::printing() {
+  return (current == SPOOL_NONE) ? 0 : (buf[current] | (buf[current + 1] << 8));
+}
+
+uint8_t Pos_Spool::pending() {
+  uint32_t at;
+  uint8_t  n = 0;
+
+  for(at=0; at<len; at += SPOOL_HEADER + jobLength(at)) n++;
+  return n;
+}
+
+bool Pos_Spool::cancel(uint16_t id) {
+  uint32_t at = find(id);
+
+  if(at == SPOOL_NONE) return false;
+  if(at == current) {
+    printer.abort(); // Drop what the printer already has of it
+    current = SPOOL_NONE;
+  }
+  remove(at);
+  return true;
+}
+
+bool Pos_Spool::service() {
+  uint32_t at;
+
+  if(current == SPOOL_NONE) {
+    if(!len) return false;
+    // Highest priority wins; the earliest of equals is found first
+    for(at=current=0; at<len; at += SPOOL_HEADER + jobLength(at)) {
+      if(buf[at + 2] > buf[current + 2]) current = at;
+    }
+    printer.beginReplay();
+  }
+  if(printer.replayStep(buf + current + SPOOL_HEADER, jobLength(current))) {
+    at      = current;
+    current = SPOOL_NONE;
+    remove(at);
+  }
+  return len > 0;
+}
+
+// === Asset cache ===
+
+Pos_AssetCache::Pos_AssetCache(Pos_Printer &p, Pos_Asset *slots, uint8_t n, char prefix) :
+  printer(p), slots(slots), n((n > 64) ? 64 : n), prefix(prefix), clock(0) {
+  for(uint8_t i=0; i<this->n; i++) { // Carry on from a saved table
+    if(slots[i].used > clock) clock = slots[i].used;
+  }
+}
+
+uint32_t Pos_AssetCache::hash(const void *data, uint32_t len, uint32_t seed) {
+  const uint8_t *p = (const uint8_t *)data;
+
+  while(len--) seed = (seed ^ *p++) * 16777619UL;
+  return seed;
+}
+
+void Pos_AssetCache::clear() {
+  memset(slots, 0, n * sizeof(Pos_Asset));
+  clock = 0;
+}
+
+// Finds the slot holding id or, failing that, the one to replace.
+uint8_t Pos_AssetCache::lookup(uint32_t id, bool *hit) {
+  uint8_t i, oldest = 0;
+
+  for(i=0; i<n; i++) {
+    if(slots[i].used && slots[i].id == id) {
+      *hit = true;
+      slots[i].used = ++clock;
+      return i;
+    }
+    if(slots[i].used < slots[oldest].used) oldest = i;
+  }
+  *hit = false;
+  slots[oldest].id   = id;
+  slots[oldest].used = ++clock;
+  return oldest;
+}
+
+bool Pos_AssetCache::print(int w, int h, const uint8_t *bitmap, bool fromProgMem) {
+  uint8_t  buf[POS_CHUNK_BYTES];
+  uint32_t id, len = (uint32_t)((w + 7) / 8) * h, i;
+  int16_t  size[] = { (int16_t)w, (int16_t)h };
+  char     key[] = { prefix, 0 };
+  bool     hit;
+
+  id = hash(size, sizeof(size));
+  for(i=0; i<len; i += sizeof(buf)) {
+    uint16_t k = (len - i > sizeof(buf)) ? sizeof(buf) : len - i;
+    if(fromProgMem) memcpy_P(buf, bitmap + i, k);
+    else            memcpy(buf, bitmap + i, k);
+    id = hash(buf, k, id);
+  }
+  key[1] = '0' + lookup(id, &hit);
+  if(!hit) {
+    printer.deleteNVGraphic(key);
+    printer.defineNVGraphic(key, w, h, bitmap, fromProgMem);
+  }
+  printer.printNVGraphic(key, h);
+  return hit;
+}
+
+// For images made by a converter (e.g. Pos_Dither::row): id stands for
+// the source and settings, so a repeat skips the conversion too.
+bool Pos_AssetCache::print(uint32_t id, int w, int h, Pos_RowCallback fill, void *arg) {
+  char key[] = { prefix, 0 };
+  bool hit;
+
+  key[1] = '0' + lookup(id, &hit);
+  if(!hit) {
+    if(w > POS_MAX_ROW_BYTES * 8) w = POS_MAX_ROW_BYTES * 8;
+    Pos_RowSource source(w, fill, arg);
+    printer.deleteNVGraphic(key);
+    printer.defineNVGraphic(key, w, h, source);
+  }
+  printer.printNVGraphic(key, h);
+  return hit;
+}
@@ -121,6 +121,305 @@
  #define MSI     10
 #endif
 
+// Largest block of image data moved to the printer in one go.  One full
+// 384-dot row, so the raster paths issue a row per bulk write.
+#define POS_CHUNK_BYTES 48
+
+// Byte sources for the raster and NV image uploaders.  The uploaders are
+// templates over the source type, so where the data lives is decided at
+// compile time rather than tested for every byte.  A source hands out
+// data in blocks via read(dst, n) and drops clipped bytes via skip(n);
+// anything derived from Pos_Source<T> providing those two methods (e.g.
+// a decompressor) works with every image path.
+template<class T> class Pos_Source { };
+
+// Image in RAM
+class Pos_RamSource : public Pos_Source<Pos_RamSource> {
+ public:
+  Pos_RamSource(const uint8_t *data) : ptr(data) { }
+  void read(uint8_t *dst, uint16_t n) { memcpy(dst, ptr, n); ptr += n; }
+  void skip(uint16_t n)               { ptr += n; }
+  const uint8_t *take(uint16_t n)     { ptr += n; return ptr - n; } // In place
+ private:
+  const uint8_t *ptr;
+};
+
+// Image in flash (PROGMEM)
+class Pos_ProgmemSource : public Pos_Source<Pos_ProgmemSource> {
+ public:
+  Pos_ProgmemSource(const uint8_t *data) : ptr(data) { }
+  void read(uint8_t *dst, uint16_t n) { memcpy_P(dst, ptr, n); ptr += n; }
+  void skip(uint16_t n)               { ptr += n; }
+ private:
+  const uint8_t *ptr;
+};
+
+// Image arriving on a Stream (e.g. an SD card file or serial link).
+// Blocks until each byte is available, as the Stream bitmap calls always
+// did, so never ask for more than the stream will deliver: at the end of
+// a file that wait never ends (printBitmapFile() checks this for you).
+class Pos_StreamSource : public Pos_Source<Pos_StreamSource> {
+ public:
+  Pos_StreamSource(Stream *s) : stream(s) { }
+  void read(uint8_t *dst, uint16_t n) {
+    size_t got;
+    int    c;
+    // Bulk read first (one call per block for files); bytes still to
+    // come on a slow link are then waited for one at a time.
+    got  = stream->readBytes(dst, n);
+    dst += got;
+    n   -= got;
+    while(n--) {
+      while((c = stream->read()) < 0);
+      *dst++ = c;
+    }
+  }
+  void skip(uint16_t n) {
+    uint8_t buf[16];
+    while(n) {
+      uint16_t len = (n > sizeof(buf)) ? sizeof(buf) : n;
+      read(buf, len);
+      n -= len;
+    }
+  }
+ private:
+  Stream *stream;
+};
+
+// Widest row a generated image may have: 576 dots, an 80mm print head.
+#define POS_MAX_ROW_BYTES 72
+
+// Fills one row (rowBytes bytes, MSB = leftmost dot) of a generated
+// image.  y counts from 0 at the top; arg is passed through unchanged.
+typedef void (*Pos_RowCallback)(uint8_t *row, int y, void *arg);
+
+// Image produced a row at a time by a callback, e.g. rules, gradient bars,
+// progress meters or test patterns.  Costs no flash and one row of RAM,
+// whatever the height.
+class Pos_RowSource : public Pos_Source<Pos_RowSource> {
+ public:
+  Pos_RowSource(int w, Pos_RowCallback fill, void *arg=NULL) :
+    callback(fill), arg(arg), y(0) {
+    rowBytes = (w + 7) / 8;
+    if(rowBytes > POS_MAX_ROW_BYTES) rowBytes = POS_MAX_ROW_BYTES;
+    pos = rowBytes; // Generate on first read
+  }
+  void read(uint8_t *dst, uint16_t n) {
+    uint16_t len;
+    while(n) {
+      if(pos == rowBytes) nextRow();
+      len = rowBytes - pos;
+      if(len > n) len = n;
+      memcpy(dst, row + pos, len);
+      dst += len;
+      pos += len;
+      n   -= len;
+    }
+  }
+  void skip(uint16_t n) {
+    uint16_t len;
+    while(n) {
+      if(pos == rowBytes) nextRow();
+      len = rowBytes - pos;
+      if(len > n) len = n;
+      pos += len;
+      n   -= len;
+    }
+  }
+ private:
+  void nextRow() {
+    callback(row, y++, arg);
+    pos = 0;
+  }
+  Pos_RowCallback callback;
+  void    *arg;
+  int      y;
+  uint16_t rowBytes, pos;
+  uint8_t  row[POS_MAX_ROW_BYTES];
+};
+
+// Rows from a callback, prepared ahead into a bounded ring of rows so the
+// work can overlap the printer's pacing waits: install idle() with
+// setIdleCallback() and each wait prepares another row, while the
+// printer starts on the first rows at once.  Rows the pipeline hasn't
+// reached yet are prepared when they are read.  buf holds rows rows of
+// (w + 7) / 8 bytes.
+//   Pos_RowQueue queue(384, h, buf, 24, ditherRow, &photo);
+//   printer.setIdleCallback(Pos_RowQueue::idle, &queue);
+//   printer.printBitmap(384, h, queue);
+//   printer.setIdleCallback(NULL);
+class Pos_RowQueue : public Pos_Source<Pos_RowQueue> {
+ public:
+  Pos_RowQueue(int w, int h, uint8_t *buf, uint16_t rows,
+               Pos_RowCallback fill, void *arg=NULL) :
+    buf(buf), rows(rows), head(0), count(0), pos(0),
+    y(0), h(h), callback(fill), arg(arg) {
+    rowBytes = (w + 7) / 8;
+  }
+  bool prepare() { // Makes one more row; false if full or finished
+    if(count == rows || y >= h) return false;
+    callback(buf + (uint32_t)((head + count) % rows) * rowBytes, y++, arg);
+    count++;
+    return true;
+  }
+  static void idle(void *queue) {
+    static_cast<Pos_RowQueue *>(queue)->prepare();
+  }
+  void read(uint8_t *dst, uint16_t n) { take(dst, n); }
+  void skip(uint16_t n)               { take(NULL, n); }
+ private:
+  void take(uint8_t *dst, uint16_t n) {
+    uint16_t len;
+    while(n) {
+      if(!count && !prepare()) { // Read past the last row
+        if(dst) memset(dst, 0, n);
+        return;
+      }
+      len = rowBytes - pos;
+      if(len > n) len = n;
+      if(dst) {
+        memcpy(dst, buf + (uint32_t)head * rowBytes + pos, len);
+        dst += len;
+      }
+      pos += len;
+      n   -= len;
+      if(pos == rowBytes) { // Row done, free its slot
+        pos = 0;
+        if(++head == rows) head = 0;
+        count--;
+      }
+    }
+  }
+  uint8_t        *buf;
+  uint16_t        rows, head, count, pos, rowBytes;
+  int             y, h;
+  Pos_RowCallback callback;
+  void           *arg;
+};
+
+// Fills gray with one row of w 8-bit pixels (0 = black, 255 = white).
+typedef void (*Pos_GrayCallback)(uint8_t *gray, int y, void *arg);
+
+// Floyd-Steinberg error diffusion from grayscale rows to packed 1-bit
+// rows, one row at a time, so a photo never needs to be held whole.  Use
+// row() as a Pos_RowCallback, e.g. printBitmap(w, h, Pos_Dither::row,
+// &dither).  err needs w + 1 entries and line w bytes.  For whole images
+// on boards or hosts with threads, see Pos_DitherThreads.h.
+class Pos_Dither {
+ public:
+  Pos_Dither(int w, Pos_GrayCallback gray, void *arg, int16_t *err, uint8_t *line) :
+    w(w), gray(gray), arg(arg), err(err), line(line) { }
+  static void row(uint8_t *row, int y, void *dither);
+ private:
+  int              w;
+  Pos_GrayCallback gray;
+  void            *arg;
+  int16_t         *err;  // Error carried into the next row; err[x + 1] is column x
+  uint8_t         *line;
+};
+
+// Thresholds w gray pixels (below threshold prints black) into a packed
+// 1-bit row, MSB first as printBitmap() expects.  Returns the number of
+// black dots, so 0 means a blank row.  16 pixels a step with SSE2.
+uint16_t Pos_packRow(uint8_t *row, const uint8_t *gray, int w, uint8_t threshold=128);
+
+// Like Pos_packRow(), but dithered against a blue-noise threshold tile:
+// close to error diffusion in looks, at thresholding speed and memory.
+// y is the row's position in the image.
+uint16_t Pos_blueNoiseRow(uint8_t *row, const uint8_t *gray, int w, int y);
+
+// One image for defineNVBitmaps(); same layout as defineNVBitmap().
+struct Pos_NVImage {
+  int            w, h;
+  const uint8_t *bitmap;
+  bool           fromProgMem;
+};
+
+// Bounded in-RAM store for captured jobs (see Pos_Printer::beginCapture()),
+// in caller-supplied memory.  Writes past the end are dropped and
+// flagged rather than wrapped, so a job is either whole or known to be
+// truncated.  Reads return the contents from the start (see rewind()).
+class Pos_JobBuffer : public Stream {
+ public:
+  Pos_JobBuffer(uint8_t *buf, uint32_t size) :
+    buf(buf), size(size), len(0), pos(0), full(false) { }
+  size_t write(uint8_t c) {
+    if(len >= size) {
+      full = true;
+      return 0;
+    }
+    buf[len++] = c;
+    return 1;
+  }
+  size_t write(const uint8_t *data, size_t n) {
+    if(n > size - len) {
+      n    = size - len;
+      full = true;
+    }
+    memcpy(buf + len, data, n);
+    len += n;
+    return n;
+  }
+  using Print::write;
+  int  available() { return len - pos; }
+  int  read()      { return (pos < len) ? buf[pos++] : -1; }
+  int  peek()      { return (pos < len) ? buf[pos]   : -1; }
+  void flush()     { }
+  void clear()     { len = pos = 0; full = false; }
+  void truncate(uint32_t n) { // Keep only the first n bytes
+    if(n < len) len = n;
+    if(pos > len) pos = len;
+    full = false;
+  }
+  void discard(uint32_t n) { // Drop the first n bytes
+    if(n > len) n = len;
+    memmove(buf, buf + n, len - n);
+    len -= n;
+    pos  = (pos > n) ? pos - n : 0;
+  }
+  void rewind()    { pos = 0; }
+  const uint8_t *data()       const { return buf; }
+  uint32_t       length()     const { return len; }
+  bool           overflowed() const { return full; }
+ private:
+  uint8_t *buf;
+  uint32_t size, len, pos;
+  bool     full;
+};
+
+class Pos_Printer;
+
+// Label design for printLabels().  setup() issues the commands shared by
+// every label (sizes, barcode height, ...) once per run; render() prints
+// one record's label.
+struct Pos_LabelLayout {
+  void (*setup)(Pos_Printer &printer);
+  void (*render)(Pos_Printer &printer, const void *record);
+};
+
+// Returns the next record for printLabels(), or NULL when done.
+typedef const void *(*Pos_RecordIterator)(void *arg);
+
+// Result of printLabels()
+struct Pos_LabelStats {
+  unsigned long labels,    // Labels printed
+                elapsed,   // Microseconds, first byte to last label fed
+                perMinute; // Sustained rate
+};
+
+// Reopens the printer's serial port at baud, for negotiateBaud().
+typedef void (*Pos_BaudCallback)(unsigned long baud);
+
+// Called while the library waits on the printer; see setIdleCallback().
+typedef void (*Pos_IdleCallback)(void *arg);
+
+// Called as each completion reply arrives; see trackCompletion().
+typedef void (*Pos_CompletionCallback)(uint16_t id, unsigned long elapsed, void *arg);
+
+// Completion requests sent but not yet answered, tracked by the printer
+// object.  Further requests push out the oldest.
+#define POS_COMPLETION_QUEUE 4
+
 class Pos_Printer : public Print {
 
  public:
@@ -130,7 +429,9 @@ class Pos_Printer : public Print {
   Pos_Printer(Stream *s=&Serial, uint8_t dtr=255);
 
   size_t
-    write(uint8_t c);
+    write(uint8_t c),
+    write(const uint8_t *buffer, size_t size);
+  using Print::write;
   void
     begin(uint8_t heatTime=120),
     boldOff(),
@@ -156,11 +457,17 @@ class Pos_Printer : public Print {
     printBitmap_ada(int w, int h, const uint8_t *bitmap, bool fromProgMem=true),
     printBitmap_ada(int w, int h, Stream *fromStream),
     printBitmap_ada(Stream *fromStream),
+    printBitmapFile(Stream *file),
+    printBitmap(int w, int h, Pos_RowCallback fill, void *arg=NULL),
+    printBitmap_ada(int w, int h, Pos_RowCallback fill, void *arg=NULL),
 
     normal(),
     reset(),
     reprintQRcode(uint16_t timeoutQR=4000000L), // Only works on printers with support for this feature
     setBarcodeHeight(uint8_t val=50),
+    setBaudRate(unsigned long baud),
+    setBufferSize(unsigned long bytes),
+    setIdleCallback(Pos_IdleCallback idle, void *arg=NULL),
     setCharSpacing(int spacing=0), // Only works w/recent firmware
     setCharset(uint8_t val=0),
     setCodePage(uint8_t val=0),
@@ -185,6 +492,7 @@ class Pos_Printer : public Print {
     wake(),
 
   	cut(),
+    partialCut(),
   	beep(),
     defineBitImage( int w, int h, const uint8_t *bitmap),
     printDefinedBitImage(int mode=0),
@@ -193,13 +501,141 @@ class Pos_Printer : public Print {
     defineNVBitmap(int w1, int h1, const uint8_t *bitmap1,int w2, int h2, const uint8_t *bitmap2),
     setBeep(int sec);
 
+  // Image uploads from any Pos_Source (see above)
+  template<class T> void
+    printBitmap(int w, int h, Pos_Source<T> &source);
+  template<class T> void
+    printBitmap_ada(int w, int h, Pos_Source<T> &source);
+  template<class T> void
+    defineBitImage(int w, int h, Pos_Source<T> &source);
+  template<class T> void
+    defineNVBitmap(int w, int h, Pos_Source<T> &source);
+  template<class T1, class T2> void
+    defineNVBitmap(int w1, int h1, Pos_Source<T1> &source1,
+                   int w2, int h2, Pos_Source<T2> &source2);
+
+  // Raster session of open-ended height: beginRaster(width), then
+  // pushRows() as often as needed, then endRaster().  Without a stage
+  // buffer each call's rows go straight out as their own band(s).  Given
+  // one, rows are gathered into full bands however few each call brings
+  // (e.g. one row at a time from a live trace): a band goes out when it
+  // reaches chunkLimit() rows or fills the stage, and endRaster() sends
+  // the last one.
+  void
+    beginRaster(int w, uint8_t *stage=NULL, uint16_t stageSize=0),
+    pushRows(const uint8_t *rows, int count=1, bool fromProgMem=false),
+    endRaster();
+  template<class T> void
+    pushRows(Pos_Source<T> &source, int count);
+
+  // Key-addressed NV graphics (GS ( L / GS 8 L).  Each image is stored
+  // under a two-character key (e.g. "LG"), so one image can be replaced
+  // or deleted without rewriting the rest as FS q does.  Flash write
+  // time is included in the pacing; see setNVTimes().
+  void
+    defineNVGraphic(const char *key, int w, int h, const uint8_t *bitmap, bool fromProgMem=true),
+    deleteNVGraphic(const char *key),
+    deleteAllNVGraphics(),
+    printNVGraphic(const char *key, int h=0, uint8_t scaleX=1, uint8_t scaleY=1),
+    setNVTimes(unsigned long base, unsigned long perByte);
+  template<class T> void
+    defineNVGraphic(const char *key, int w, int h, Pos_Source<T> &source);
+  long
+    NVGraphicsRemaining(); // Free NV graphics bytes, -1 if no reply
+  int
+    listNVGraphics(char *keys, int max); // Fills 2 chars per key, returns count
+
+  // Printer-side macro (GS :).  Calls made between beginMacro() and
+  // endMacro() are stored by the printer instead of printed; runMacro()
+  // then prints them count times, interval * 100 ms apart, for only a
+  // few bytes on the link.  Macros hold up to 2048 bytes and are lost
+  // when the printer is powered off.
+  void
+    beginMacro(),
+    endMacro(),
+    runMacro(uint8_t count=1, uint8_t interval=0);
+
+  // Capture and replay of encoded jobs, e.g. for instant reprints.
+  void
+    beginCapture(Print *sink, bool transmit=true, bool inPlace=false),
+    endCapture(),
+    discardCapture(), // Undo the capture's effect on layout state
+    replay(const uint8_t *job, uint32_t len),
+    replay(Pos_JobBuffer &job),
+    replay(Stream *job);
+  void
+    beginReplay(); // Start replayStep() from the top of a job
+  bool
+    replayStep(const uint8_t *job, uint32_t len);
+  static void
+    broadcast(Pos_Printer **printers, uint8_t n, const uint8_t *job, uint32_t len),
+    broadcast(Pos_Printer **printers, uint8_t n, Pos_JobBuffer &job);
+
+  // Cancels the job in progress: clears the printer's buffers with the
+  // real-time command DLE DC4 8, so data already sent isn't printed, and
+  // resynchronises the library's state so the next job can start at
+  // once.  Call abort() from the main program, a yield() hook or an
+  // idle callback; a call in progress stops at its next write.  From an
+  // interrupt use requestAbort(), which only raises a flag: the clear is
+  // sent by the library at its next write or ready() check.
+  void
+    abort(),
+    requestAbort();
+
+  // Physical completion tracking (GS ( H process ID response).  The
+  // printer answers a completion request only once everything before it
+  // has printed, giving the true time from a job's first byte to paper.
+  // With trackCompletion(true), cut() requests one automatically.  A
+  // request is tracked from when it reaches the printer, not when it is
+  // encoded, so requests in a capture, spool or open job time the job
+  // they end once replayed.  Up to POS_COMPLETION_QUEUE may be in flight;
+  // done, if given, gets each job's ID and time as its reply arrives.
+  void
+    trackCompletion(bool on, Pos_CompletionCallback done=NULL, void *arg=NULL);
+  uint16_t
+    requestCompletion(); // Returns the ID sent, 0-9999
+  bool
+    completionPending(), // Reads any replies; true while any is outstanding
+    waitCompletion(unsigned long timeout=10000);
+  unsigned long
+    completionTime(),    // Microseconds, first byte to printed, of last reply
+    readyIn(),           // Microseconds until ready() (a poll interval with DTR)
+    getBaudRate(),
+    getBufferSize(),
+    probeBufferSize(unsigned long maxBytes=16384),
+    negotiateBaud(Pos_BaudCallback setPort, const unsigned long *rates=NULL, uint8_t n=0);
+
+  // Label stock (die-cut with gaps, or black mark); sizes in dots.
+  void
+    labelOn(uint16_t height, uint16_t gap=24, bool blackMark=false),
+    labelOff(),
+    labelFeed(); // Advance to the start of the next label
+  uint16_t
+    getLabelHeight(); // 0 when not in label mode
+  Pos_LabelStats
+    printLabels(const Pos_LabelLayout &layout, Pos_RecordIterator next, void *arg,
+                Pos_JobBuffer &scratch);
+
   bool
+    ready(),
+    macroDefined(),
+    defineNVBitmaps(const Pos_NVImage *images, uint8_t n, unsigned long timeout=30000),
+    waitReady(unsigned long timeout=5000),
     hasPaper();
 
  private:
 
+  friend class Pos_OpenJob;
+  friend class Pos_Spool;
+
   Stream
     *stream;
+  Print
+    *captureSink;   // Where beginCapture() records output, NULL if not capturing
+  Pos_IdleCallback
+    idleCallback;   // Run during pacing waits, see setIdleCallback()
+  void
+    *idleArg;
   uint8_t
     printMode,
     prevByte,      // Last character issued to printer
@@ -210,12 +646,77 @@ class Pos_Printer : public Print {
     barcodeHeight, // Barcode height in dots, not including text
     maxChunkHeight,
     dtrPin;        // DTR handshaking pin (experimental)
+  int
+    rasterRowBytes; // Row width of open raster session, 0 if none
+  uint8_t
+    *rasterStage,  // Caller's band buffer, NULL to send rows as pushed
+    rasterRows;    // Rows in rasterStage
+  uint16_t
+    rasterStageSize;
+  uint16_t
+    labelHeight,   // Printable label length in dots, 0 if not in label mode
+    labelGap,      // Gap (or mark) between labels, in dots
+    labelRow,      // Dots used on the current label
+    captureLabelRow; // labelRow at beginCapture(), see discardCapture()
+  uint8_t
+    captureColumn,   // Likewise column and prevByte
+    capturePrevByte;
+  boolean
+    dtrEnabled,    // True if DTR pin set & printer initialized
+    macroRecording, // True between beginMacro() and endMacro()
+    macroResident,  // True once a macro has been stored this session
+    captureTransmit, // False if capturing without sending
+    captureInPlace;  // Record RAM images by address, not by value
+  uint8_t
+    captureStage[16], // Capture data not yet written as a record
+    captureCount;
+  uint16_t
+    lastWrite;     // Size of last write, whose transmit time isn't a print delay
+  uint32_t
+    replayPos;     // Progress of replayStep() through its job
+  uint8_t
+    jobDepth;      // Nesting of Job scopes in progress
+  volatile boolean
+    aborted,       // Set by abort() until the interrupted call returns
+    abortPending;  // Clear command not yet sent, see requestAbort()
   boolean
-    dtrEnabled;    // True if DTR pin set & printer initialized
+    completionOnCut,   // trackCompletion() setting
+    jobStarted;        // Bytes sent since the last completion request
+  uint8_t
+    replyState,        // Progress through a 37h 22h d1..d4 00h reply
+    completionCount;   // Requests sent, reply not yet seen
+  uint16_t
+    completionId,      // ID of the last request encoded
+    replyId,           // ID digits of the reply being read
+    completionIds[POS_COMPLETION_QUEUE]; // Outstanding, oldest first
+  unsigned long
+    jobStartTime,      // micros() at the first byte of the current job
+    completionStarts[POS_COMPLETION_QUEUE], // jobStartTime of each
+    completionElapsed; // Result for the last completed request
+  Pos_CompletionCallback
+    completionCallback;
+  void
+    *completionArg;
+
+  // Marks a call that abort() can cut short.  The abort flag clears when
+  // the outermost one returns.
+  class Job {
+   public:
+    Job(Pos_Printer *p) : printer(p) { printer->jobDepth++; }
+    ~Job() { if(!--printer->jobDepth) printer->aborted = false; }
+   private:
+    Pos_Printer *printer;
+  };
   unsigned long
+    baudRate,      // Port speed, see setBaudRate()
+    byteTime,      // Time to issue one byte at baudRate, in microseconds
+    bufferSize,    // Printer receive buffer size, in bytes
     resumeTime,    // Wait until micros() exceeds this before sending byte
     dotPrintTime,  // Time to print a single dot line, in microseconds
-    dotFeedTime;   // Time to feed a single dot line, in microseconds
+    dotFeedTime,   // Time to feed a single dot line, in microseconds
+    nvWriteTime,   // Fixed cost of an NV graphics write, in microseconds
+    nvByteTime,    // Flash write time per NV graphics byte, in microseconds
+    macroTime;     // Estimated time to run the stored macro once
   void
     writeBytes(uint8_t a),
     writeBytes(uint8_t a, uint8_t b),
@@ -226,8 +727,297 @@ class Pos_Printer : public Print {
 	
     setPrintMode(uint8_t mask),
     unsetPrintMode(uint8_t mask),
-    writePrintMode();
+    writePrintMode(),
+    writeBuffer(const uint8_t *buf, uint16_t n, bool inPlace=false),
+    emit(const uint8_t *buf, uint16_t n, bool inPlace=false),
+    abortFlush(),
+    noteCompletion(const uint8_t *buf, uint16_t n),
+    timeoutUnits(const unsigned long *n),
+    timeoutDots(unsigned long printRows, unsigned long feedRows=0, unsigned long bytes=0),
+    timeoutNV(unsigned long bytes),
+    captureWrite32(unsigned long x),
+    captureWriteCount(unsigned long x),
+    flushRaster(),
+    writeSource(Pos_Source<Pos_RamSource> &source, uint32_t n),
+    labelAdvance(uint16_t dots),
+    captureFlush(),
+    writeChunkHeader(int rows, int rowBytes),
+    writeNVHeader(int w, int h);
+  bool
+    switchBaud(Pos_BaudCallback setPort, unsigned long baud);
+  unsigned long
+    findBaud(Pos_BaudCallback setPort, const unsigned long *rates, uint8_t n),
+    paceTime(uint8_t unit);
+  int
+    writeRasterHeader(int w, int h),
+    chunkLimit(int rowBytes),
+    labelRoom(int rows),
+    readResponse(uint8_t id, uint8_t *buf, int max, unsigned long timeout=3000);
+  uint32_t
+    writeNVGraphicHeader(const char *key, int w, int h);
+  template<class T> void
+    writeSource(Pos_Source<T> &source, uint32_t n);
+
+};
+
+// Copies n bytes from the source to the printer in POS_CHUNK_BYTES blocks.
+template<class T>
+void Pos_Printer::writeSource(Pos_Source<T> &source, uint32_t n) {
+  T       &src = static_cast<T &>(source);
+  uint8_t  buf[POS_CHUNK_BYTES];
+  uint16_t len;
+
+  while(n && !aborted) {
+    len = (n > sizeof(buf)) ? sizeof(buf) : n;
+    src.read(buf, len);
+    writeBuffer(buf, len);
+    n -= len;
+  }
+}
+
+template<class T>
+void Pos_Printer::printBitmap(int w, int h, Pos_Source<T> &source) {
+  Job job(this);
+  int fit      = labelRoom(h),
+      rowBytes = writeRasterHeader(w, fit);
+
+  writeSource(source, (uint32_t)rowBytes * fit);
+  static_cast<T &>(source).skip((uint32_t)rowBytes * (h - fit));
+  timeoutDots(fit);
+  labelAdvance(fit);
+  prevByte = '\n';
+}
+
+template<class T>
+void Pos_Printer::printBitmap_ada(int w, int h, Pos_Source<T> &source) {
+  Job job(this);
+  beginRaster(w);
+  pushRows(source, h);
+  endRaster();
+}
+
+// Sends count rows of the open raster session, in bands of up to
+// chunkLimit() rows, or adds them to the stage buffer's band if there
+// is one.  Rows wider than 384 dots are clipped.
+template<class T>
+void Pos_Printer::pushRows(Pos_Source<T> &source, int count) {
+  Job  job(this);
+  T   &src = static_cast<T &>(source);
+  int  rowBytesClipped, chunkHeight, chunkHeightLimit, y, rest;
+
+  if(!rasterRowBytes) return; // No beginRaster()
+
+  rowBytesClipped  = (rasterRowBytes >= 48) ? 48 : rasterRowBytes; // 384 pixels max width
+  chunkHeightLimit = chunkLimit(rowBytesClipped);
+  y                = labelRoom(rasterRows + count) - rasterRows; // Staged rows aren't on the label yet
+  rest             = count - y; // Off the end of the label
+  count            = y;
+
+  if(rasterStage) {
+    if(chunkHeightLimit > rasterStageSize / rowBytesClipped)
+      chunkHeightLimit = rasterStageSize / rowBytesClipped;
+    for(; count > 0 && !aborted; count--) {
+      src.read(rasterStage + rasterRows * rowBytesClipped, rowBytesClipped);
+      src.skip(rasterRowBytes - rowBytesClipped);
+      if(++rasterRows >= chunkHeightLimit) flushRaster();
+    }
+  }
+  while(count > 0 && !aborted) {
+    // Issue up to chunkHeightLimit rows at a time:
+    chunkHeight = count;
+    if(chunkHeight > chunkHeightLimit) chunkHeight = chunkHeightLimit;
+
+    writeChunkHeader(chunkHeight, rowBytesClipped);
+
+    for(y=0; y < chunkHeight; y++) {
+      writeSource(source, rowBytesClipped);
+      src.skip(rasterRowBytes - rowBytesClipped);
+    }
+    timeoutDots(chunkHeight);
+    labelAdvance(chunkHeight);
+    count -= chunkHeight;
+  }
+  for(; rest > 0 && !aborted; rest--) src.skip(rasterRowBytes);
+}
+
+// Column-format image for GS /; see notes on the pointer version in the .cpp.
+template<class T>
+void Pos_Printer::defineBitImage(int w, int h, Pos_Source<T> &source) {
+  Job job(this);
+  int rowBytes = (w + 7) / 8, // Round up to next byte boundary
+      colBytes = (h + 7) / 8;
+
+  writeBytes(0x1D, 0x2A, rowBytes, colBytes);
+  writeSource(source, (uint32_t)rowBytes * h);
+  timeoutDots(h);
+  prevByte = '\n';
+}
+
+// n=1 NV image
+template<class T>
+void Pos_Printer::defineNVBitmap(int w, int h, Pos_Source<T> &source) {
+  Job job(this);
+  writeBytes(0x1C, 0x71, 1);
+  writeNVHeader(w, h);
+  writeSource(source, (uint32_t)(w / 8) * 8 * ((h + 7) / 8));
+}
 
+// n=2 NV images
+template<class T1, class T2>
+void Pos_Printer::defineNVBitmap(int w1, int h1, Pos_Source<T1> &source1,
+                                 int w2, int h2, Pos_Source<T2> &source2) {
+  Job job(this);
+  writeBytes(0x1C, 0x71, 2);
+  writeNVHeader(w1, h1);
+  writeSource(source1, (uint32_t)(w1 / 8) * 8 * ((h1 + 7) / 8));
+  writeNVHeader(w2, h2);
+  writeSource(source2, (uint32_t)(w2 / 8) * 8 * ((h2 + 7) / 8));
+}
+
+// Raster image stored under key; the printer is busy while it writes
+// flash, so the next command waits for the estimated write time.
+template<class T>
+void Pos_Printer::defineNVGraphic(const char *key, int w, int h, Pos_Source<T> &source) {
+  Job      job(this);
+  uint32_t n = writeNVGraphicHeader(key, w, h);
+
+  writeSource(source, n);
+  timeoutNV(n);
+}
+
+// A job that starts printing before it is complete, e.g. a receipt whose
+// logo and header print while the order is still being rung up.  Calls
+// made between beginAppend() and endAppend() are encoded into the job's
+// queue; service(), called often (e.g. from loop()), sends queued data
+// whenever the printer is ready, without blocking.  close() marks the
+// end (after the totals and cut); service() returns true once all of it
+// is out.  An append that doesn't fit in what is left of the queue is
+// dropped whole and endAppend() returns false: service() until more has
+// gone out and append it again.  Size the queue for the largest single
+// append.
+class Pos_OpenJob {
+ public:
+  Pos_OpenJob(Pos_Printer &printer, uint8_t *buf, uint32_t size);
+  void
+    beginAppend(),
+    close();
+  bool
+    endAppend(),  // False if the append was dropped
+    service(),
+    overflowed(); // Last append was dropped
+ private:
+  Pos_Printer  &printer;
+  Pos_JobBuffer queue;
+  uint32_t      mark;  // Queue length before the append in progress
+  bool          appending, closed, dropped;
+};
+
+// Prints one ticket or receipt; see Pos_Coalescer.
+typedef void (*Pos_TicketCallback)(Pos_Printer &printer, const void *arg);
+
+// Separators between coalesced tickets
+#define POS_SEPARATE_RULE        0 // Printed full-width rule
+#define POS_SEPARATE_PARTIAL_CUT 1 // Partial cut
+
+// Merges tickets that arrive within a time window into one print run,
+// e.g. a kitchen printer during a rush.  Tickets are separated by a rule
+// or a partial cut, and only the run as a whole gets the final feed and
+// full cut, instead of every ticket paying for its own.  A ticket waits
+// at most window ms (plus the print time of the run) before printing.
+// submit() takes a function that prints the ticket (without its own
+// feed and cut); call service() often, e.g. from loop().
+class Pos_Coalescer {
+ public:
+  Pos_Coalescer(Pos_Printer &printer, uint8_t *buf, uint32_t size,
+                unsigned long window=2000, uint8_t separator=POS_SEPARATE_RULE,
+                uint8_t feedLines=8);
+  void
+    submit(Pos_TicketCallback render, const void *arg),
+    service(),
+    flush(); // Print whatever is pending now
+ private:
+  void
+    separate();
+  Pos_Printer  &printer;
+  Pos_JobBuffer queue;
+  unsigned long window, windowStart;
+  uint8_t       separator, feedLines, pending;
+};
+
+// Job states reported by Pos_Spool::status()
+#define POS_JOB_DONE     0 // Printed, cancelled or never submitted
+#define POS_JOB_QUEUED   1
+#define POS_JOB_PRINTING 2
+
+// Queues jobs for one printer so that several producers (a serial
+// command handler, a button, a network callback...) can share it.  Each
+// job is encoded at submit time, either by a function that prints it or
+// from pre-encoded ESC/POS bytes, and gets an id for status() and
+// cancel().  With inPlace, RAM images the job prints are referenced
+// rather than copied into the spool, so they must stay untouched until
+// the job is done; handy for large rasters.  service() streams the
+// highest priority job without blocking; equal priorities print in
+// order of arrival.
+class Pos_Spool {
+ public:
+  Pos_Spool(Pos_Printer &printer, uint8_t *buf, uint32_t size);
+  uint16_t
+    submit(Pos_TicketCallback render, const void *arg, uint8_t priority=0,
+           bool inPlace=false),
+    submit(const uint8_t *escpos, uint32_t len, uint8_t priority=0),
+    printing(); // Id of the job being sent, or 0
+  uint8_t
+    status(uint16_t id),
+    pending(); // Jobs queued or printing
+  bool
+    cancel(uint16_t id),
+    service(); // Returns true while there is work left
+ private:
+  uint16_t
+    add(Pos_TicketCallback render, const void *arg, bool inPlace,
+        const uint8_t *escpos, uint32_t len, uint8_t priority);
+  uint32_t
+    find(uint16_t id),
+    jobLength(uint32_t at);
+  void
+    remove(uint32_t at);
+  Pos_Printer &printer;
+  uint8_t     *buf;
+  uint32_t     size, len, current;
+  uint16_t     nextId;
+};
+
+// One Pos_AssetCache slot.  All zero is empty; the array can be kept in
+// EEPROM so the cache survives a restart along with the printer's NV.
+struct Pos_Asset {
+  uint32_t id,   // Content hash and conversion settings
+           used; // Last use, for LRU eviction
+};
+
+// Keeps converted images (logos, product pictures) in the printer's NV
+// graphics memory, keyed by a hash of the content and of how it was
+// converted.  A repeat print is a few bytes instead of a conversion and
+// an upload; the least recently used image makes room for a new one.
+// NV memory wears with writes, so this suits images that recur.  Keys
+// are prefix plus one character per slot, so up to 64 slots.
+class Pos_AssetCache {
+ public:
+  Pos_AssetCache(Pos_Printer &printer, Pos_Asset *slots, uint8_t n, char prefix='A');
+  bool // True if the image was already on the printer
+    print(int w, int h, const uint8_t *bitmap, bool fromProgMem=true),
+    print(uint32_t id, int w, int h, Pos_RowCallback fill, void *arg=NULL);
+  void
+    clear(); // Forget everything, e.g. after deleteAllNVGraphics()
+  static uint32_t // FNV-1a; chain calls through seed to add settings
+    hash(const void *data, uint32_t len, uint32_t seed=2166136261UL);
+ private:
+  uint8_t
+    lookup(uint32_t id, bool *hit);
+  Pos_Printer &printer;
+  Pos_Asset   *slots;
+  uint8_t      n;
+  char         prefix;
+  uint32_t     clock;
 };
 
 #endif // Pos_Printer_H
@@ -0,0 +1,145 @@
+/*------------------------------------------------------------------------
+  Awaitable (C++20 coroutine) interface to Pos_Printer, for hosts that
+  drive many printers from one event loop.
+
+  Each operation is encoded at once into a per-printer job buffer, then
+  streamed out; whenever the printer's pacing says wait, the coroutine
+  suspends and asks the scheduler to resume it when the printer is due,
+  instead of spinning in timeoutWait().  One thread can then drive
+  dozens of printers, each with its own pacing.
+
+  Only built where the compiler provides <coroutine> in C++20 mode.
+  MIT license, all text above must be included in any redistribution.
+  ------------------------------------------------------------------------*/
+
+#ifndef Pos_PrinterAsync_H
+#define Pos_PrinterAsync_H
+
+#include "Pos_Printer.h"
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define POS_PRINTER_ASYNC
+
+#include <coroutine>
+#include <exception>
+
+// Resumes suspended printer operations.  Implement resumeAfter() on top
+// of the event loop's timers (e.g. a timerfd or the loop's timer queue).
+class Pos_Scheduler {
+ public:
+  virtual ~Pos_Scheduler() { }
+  virtual void resumeAfter(std::coroutine_handle<> h, unsigned long us) = 0;
+};
+
+// Result of an awaitable operation.  Starts running when called, and
+// can itself be co_await-ed to continue once the operation is complete.
+// Dropping it unfinished detaches the operation, which runs on and frees
+// itself when done.
+class Pos_Task {
+ public:
+  struct promise_type {
+    std::coroutine_handle<> continuation;
+    bool                    detached = false;
+
+    Pos_Task get_return_object() {
+      return Pos_Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        std::coroutine_handle<> next = h.promise().continuation;
+        if(h.promise().detached) h.destroy(); // Nobody left to do it
+        return next ? next : std::noop_coroutine();
+      }
+      void await_resume() noexcept { }
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Pos_Task(Pos_Task &&t) noexcept : handle(t.handle) { t.handle = nullptr; }
+  Pos_Task(const Pos_Task &) = delete;
+  ~Pos_Task() {
+    if(!handle) return;
+    if(handle.done()) handle.destroy();
+    else              handle.promise().detached = true; // Still scheduled
+  }
+
+  bool done() const { return !handle || handle.done(); }
+
+  bool await_ready() const noexcept { return done(); }
+  void await_suspend(std::coroutine_handle<> h) noexcept { handle.promise().continuation = h; }
+  void await_resume() const noexcept { }
+
+ private:
+  explicit Pos_Task(std::coroutine_handle<promise_type> h) : handle(h) { }
+  std::coroutine_handle<promise_type> handle;
+};
+
+// Suspends until the printer's pacing wait is over.
+struct Pos_ReadyAwaiter {
+  Pos_Printer   &printer;
+  Pos_Scheduler &scheduler;
+
+  bool await_ready() { return printer.ready(); }
+  void await_suspend(std::coroutine_handle<> h) {
+    scheduler.resumeAfter(h, printer.readyIn());
+  }
+  void await_resume() { }
+};
+
+// Awaitable front end for one printer.  Operations on the same printer
+// must be awaited one after another; buf must hold the largest single
+// operation once encoded (anything bigger is sent blocking instead).
+class Pos_AsyncPrinter {
+ public:
+  Pos_AsyncPrinter(Pos_Printer &p, Pos_Scheduler &s, uint8_t *buf, uint32_t size) :
+    printer(p), scheduler(s), job(buf, size) { }
+
+  // Runs encode(printer) and streams the result, suspending on pacing.
+  template<class F>
+  Pos_Task run(F encode) {
+    job.clear();
+    printer.beginCapture(&job, false);
+    encode(printer);
+    printer.endCapture();
+    if(job.overflowed()) {
+      printer.discardCapture();
+      encode(printer);
+      co_return;
+    }
+    printer.beginReplay();
+    while(!printer.replayStep(job.data(), job.length())) {
+      co_await Pos_ReadyAwaiter{ printer, scheduler };
+    }
+  }
+
+  Pos_Task println(const char *text) {
+    return run([text](Pos_Printer &p) { p.println(text); });
+  }
+  Pos_Task printBitmap(int w, int h, const uint8_t *bitmap, bool fromProgMem=true) {
+    return run([=](Pos_Printer &p) { p.printBitmap(w, h, bitmap, fromProgMem); });
+  }
+  Pos_Task printBarcode(char *text, uint8_t type) {
+    return run([=](Pos_Printer &p) { p.printBarcode(text, type); });
+  }
+  Pos_Task printQRcode(char *text, uint8_t errCorrect=48, uint8_t moduleSize=3, uint8_t model=50) {
+    return run([=](Pos_Printer &p) { p.printQRcode(text, errCorrect, moduleSize, model); });
+  }
+  Pos_Task cut() {
+    return run([](Pos_Printer &p) { p.cut(); });
+  }
+
+ private:
+  Pos_Printer   &printer;
+  Pos_Scheduler &scheduler;
+  Pos_JobBuffer  job;
+};
+
+#endif // __has_include(<coroutine>)
+#endif // C++20
+
+#endif // Pos_PrinterAsync_H
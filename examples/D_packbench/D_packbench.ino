@@ -0,0 +1,56 @@
+/*------------------------------------------------------------------------
+  Example sketch for POS Printer library for Arduino.
+  Times Pos_packRow(), which converts 8-bit gray rows to the packed 1-bit
+  rows printBitmap() expects, against a plain pixel-at-a-time loop.
+  Needs no printer; results go to the Serial Monitor.
+  ------------------------------------------------------------------------*/
+
+#include "Pos_Printer.h"
+
+#define WIDTH  384 // Full print width, in dots
+#define ROUNDS 200
+
+uint8_t gray[WIDTH], row[WIDTH / 8];
+
+// The one-pixel-at-a-time conversion Pos_packRow() replaces
+uint16_t packSimple(uint8_t *row, const uint8_t *gray, int w, uint8_t threshold) {
+  uint16_t dots = 0;
+  memset(row, 0, (w + 7) / 8);
+  for(int x=0; x<w; x++) {
+    if(gray[x] < threshold) {
+      row[x >> 3] |= 0x80 >> (x & 7);
+      dots++;
+    }
+  }
+  return dots;
+}
+
+void setup() {
+  unsigned long t;
+  unsigned long dots = 0;
+
+  Serial.begin(9600);
+  while(!Serial);
+
+  for(int x=0; x<WIDTH; x++) gray[x] = x * 255L / (WIDTH - 1); // Gradient
+
+  t = micros();
+  for(int i=0; i<ROUNDS; i++) dots += packSimple(row, gray, WIDTH, 128);
+  t = micros() - t;
+  Serial.print(F("Pixel loop:  "));
+  Serial.print((float)t / ROUNDS);
+  Serial.println(F(" us/row"));
+
+  t = micros();
+  for(int i=0; i<ROUNDS; i++) dots += Pos_packRow(row, gray, WIDTH, 128);
+  t = micros() - t;
+  Serial.print(F("Pos_packRow: "));
+  Serial.print((float)t / ROUNDS);
+  Serial.println(F(" us/row"));
+
+  Serial.print(F("Black dots per row: "));
+  Serial.println(dots / (2 * ROUNDS));
+}
+
+void loop() {
+}
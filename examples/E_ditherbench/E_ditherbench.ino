@@ -0,0 +1,74 @@
+/*------------------------------------------------------------------------
+  Example sketch for POS Printer library for Arduino.
+  Times Floyd-Steinberg dithering of a full-width photo with the serial
+  Pos_Dither kernel and with Pos_DitherThreads on 1, 2, ... threads, and
+  checks every threaded result is bit-identical to the serial one.
+  Needs a board with std::thread (e.g. ESP32) and no printer; results
+  go to the Serial Monitor.
+  ------------------------------------------------------------------------*/
+
+#include "Pos_Printer.h"
+#include "Pos_DitherThreads.h"
+
+#define WIDTH   384 // Full print width, in dots
+#define HEIGHT  200
+#define THREADS 4   // Most threads tried
+
+#define ROW_BYTES ((WIDTH + 7) / 8)
+
+uint8_t *gray, *serial, *threaded;
+int16_t  err[WIDTH + 1];
+uint8_t  line[WIDTH];
+
+// Rows of the test image, for Pos_Dither
+void grayRow(uint8_t *row, int y, void *arg) {
+  memcpy(row, gray + (long)y * WIDTH, WIDTH);
+}
+
+void setup() {
+  unsigned long t;
+
+  Serial.begin(9600);
+  while(!Serial);
+
+#ifdef POS_DITHER_THREADS
+  gray     = (uint8_t *)malloc((long)WIDTH * HEIGHT);
+  serial   = (uint8_t *)malloc((long)ROW_BYTES * HEIGHT);
+  threaded = (uint8_t *)malloc((long)ROW_BYTES * HEIGHT);
+  if(!gray || !serial || !threaded) {
+    Serial.println(F("Not enough memory"));
+    return;
+  }
+  for(int y=0; y<HEIGHT; y++) { // Diagonal gradient with some texture
+    for(int x=0; x<WIDTH; x++) {
+      gray[(long)y * WIDTH + x] = (x + y) * 255L / (WIDTH + HEIGHT - 2) ^ ((x * 7 + y * 13) & 15);
+    }
+  }
+
+  Pos_Dither dither(WIDTH, grayRow, NULL, err, line);
+  t = micros();
+  for(int y=0; y<HEIGHT; y++) Pos_Dither::row(serial + (long)y * ROW_BYTES, y, &dither);
+  t = micros() - t;
+  Serial.print(F("Serial:    "));
+  Serial.print(t);
+  Serial.println(F(" us"));
+
+  for(unsigned n=1; n<=THREADS; n++) {
+    memset(threaded, 0x55, (long)ROW_BYTES * HEIGHT);
+    t = micros();
+    Pos_DitherThreads::dither(threaded, gray, WIDTH, HEIGHT, n);
+    t = micros() - t;
+    Serial.print(n);
+    Serial.print(F(" thread(s): "));
+    Serial.print(t);
+    Serial.print(F(" us, "));
+    Serial.println(memcmp(serial, threaded, (long)ROW_BYTES * HEIGHT) ?
+      F("MISMATCH") : F("identical"));
+  }
+#else
+  Serial.println(F("No std::thread on this board"));
+#endif
+}
+
+void loop() {
+}